@@ -0,0 +1,458 @@
+#define _CRT_SECURE_NO_WARNINGS
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "../Common/bytecode.h"
+
+// the other tools get _strdup from Common/stats.h
+#ifndef _WIN32
+#define _strdup strdup
+#endif
+
+// Limits of the VM, so a compiled program fails where the VM would
+#define STACK_SIZE BC_STACK_SIZE
+#define CALL_DEPTH BC_CALL_DEPTH
+#define LOCALS_SIZE BC_LOCALS_SIZE
+#define MAX_REDUCTIONS BC_MAX_REDUCTIONS
+#define LINE_SIZE 512
+#define CHUNK_INSTRS 2000   // main is split into C functions of about this size
+
+// Program
+Instr* program = NULL;
+int program_len = 0;
+int program_capacity = 0;
+BcFunction* funcs = NULL;
+int func_count = 0;
+char* pool = NULL;
+uint32_t pool_size = 0;
+int mem_size = BC_DEFAULT_MEM_SIZE;
+
+// Analysis: the stack depth before every instruction is static, so each
+// depth becomes a C variable
+int* depth_at = NULL;
+int max_frame_depth = 0;
+bool uses_strings = false;
+bool uses_bounds = false;
+bool uses_divide = false;
+bool uses_kernels = false;
+int max_reductions = 0;
+OpCode (*reduce_ops)[MAX_REDUCTIONS] = NULL;
+
+void emitInstr(OpCode op, int arg) {
+    if (program_len == program_capacity) {
+        program_capacity = program_capacity ? program_capacity * 2 : 256;
+        program = realloc(program, sizeof(Instr) * program_capacity);
+    }
+    program[program_len].op = op;
+    program[program_len].arg = arg;
+    program_len++;
+}
+
+void poolConst(int32_t handle, const char* text) {
+    uint32_t offset = (uint32_t)handle >> 2;
+    int32_t len = (int32_t)strlen(text);
+    if ((handle & 3) != BC_STR_POOL) {
+        printf("Error: Bad string constant handle %d\n", handle);
+        exit(1);
+    }
+    if (offset + bcRecordSize(len) > pool_size) {
+        pool = realloc(pool, offset + bcRecordSize(len));
+        memset(pool + pool_size, 0, offset + bcRecordSize(len) - pool_size);
+        pool_size = offset + bcRecordSize(len);
+    }
+    memcpy(pool + offset, &len, 4);
+    memcpy(pool + offset + 4, text, len);
+}
+
+// Loading
+//=======================
+void loadText(FILE* fp) {
+    char line[LINE_SIZE];
+    char** func_names = NULL;
+    int* call_pcs = NULL;
+    char** callees = NULL;
+    int call_count = 0;
+
+    while (fgets(line, sizeof(line), fp)) {
+        Instr in;
+        int slot;
+        char* name;
+        BcFunction fn;
+        int kind = bcDecodeLine(line, &in, &slot, &name, &fn);
+        if (kind < 0) {
+            printf("Unknown instruction: %s\n", bcTrim(line));
+            exit(1);
+        }
+        if (kind == 2 && in.arg > mem_size) mem_size = in.arg;
+        if (kind == 4) poolConst(in.arg, name);
+        if (kind == 3) {
+            fn.pc = program_len;
+            funcs = realloc(funcs, sizeof(BcFunction) * (func_count + 1));
+            func_names = realloc(func_names, sizeof(char*) * (func_count + 1));
+            funcs[func_count] = fn;
+            func_names[func_count++] = _strdup(name);
+        }
+        if (kind != 1) continue;
+        if (in.op == OP_CALL || in.op == OP_PFOR) {
+            call_pcs = realloc(call_pcs, sizeof(int) * (call_count + 1));
+            callees = realloc(callees, sizeof(char*) * (call_count + 1));
+            call_pcs[call_count] = program_len;
+            callees[call_count++] = _strdup(name);
+        }
+        emitInstr(in.op, in.arg);
+    }
+    bool has_end = false;
+    for (int pc = 0; pc < program_len && !has_end; pc++) has_end = program[pc].op == OP_END;
+    if (!has_end) emitInstr(OP_END, 0);
+    for (int c = 0; c < call_count; c++) {
+        int f = 0;
+        while (f < func_count && strcmp(func_names[f], callees[c])) f++;
+        if (f == func_count) {
+            printf("Error: Call to undefined subroutine %s\n", callees[c]);
+            exit(1);
+        }
+        program[call_pcs[c]].arg = funcs[f].pc;
+        free(callees[c]);
+    }
+    for (int f = 0; f < func_count; f++) free(func_names[f]);
+    free(func_names);
+    free(callees);
+    free(call_pcs);
+}
+
+void readSection(FILE* fp, void* dst, uint32_t offset, size_t size) {
+    fseek(fp, offset, SEEK_SET);
+    if (size && fread(dst, 1, size, fp) != size) {
+        printf("Error: Truncated bytecode file\n");
+        exit(1);
+    }
+}
+
+void loadBinary(FILE* fp) {
+    fseek(fp, 0, SEEK_END);
+    long long size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    BytecodeHeader header;
+    if (fread(&header, sizeof(header), 1, fp) != 1 || header.instr_count == 0
+        || header.instr_offset + (long long)header.instr_count * (long long)sizeof(Instr) > size
+        || header.funcs_offset + (long long)header.funcs_count * (long long)sizeof(BcFunction) > size
+        || header.pool_offset + (long long)header.pool_size > size) {
+        printf("Error: Malformed bytecode file\n");
+        exit(1);
+    }
+    program = malloc(sizeof(Instr) * header.instr_count);
+    readSection(fp, program, header.instr_offset, sizeof(Instr) * header.instr_count);
+    program_len = header.instr_count;
+    funcs = malloc(sizeof(BcFunction) * (header.funcs_count + 1));
+    readSection(fp, funcs, header.funcs_offset, sizeof(BcFunction) * header.funcs_count);
+    func_count = header.funcs_count;
+    pool = malloc(header.pool_size + 1);
+    readSection(fp, pool, header.pool_offset, header.pool_size);
+    pool_size = header.pool_size;
+    if ((int)header.mem_size > mem_size) mem_size = header.mem_size;
+}
+
+// Analysis
+//=======================
+// The VM's checks, which also give the stack depth before every instruction
+void analyzeProgram(void) {
+    depth_at = malloc(sizeof(int) * program_len);
+    BcCheck check = { .program = program, .program_len = program_len, .funcs = funcs, .func_count = func_count,
+                      .mem_size = mem_size, .depth_at = depth_at };
+    bcCheckProgram(&check);
+    reduce_ops = check.reduce_ops;
+    max_frame_depth = check.max_frame_depth;
+    for (int pc = 0; pc < program_len; pc++) {
+        if (program[pc].op == OP_CONCAT || program[pc].op == OP_OUTS) uses_strings = true;
+        if (program[pc].op == OP_BOUND) uses_bounds = true;
+        if (program[pc].op == OP_DIV) uses_divide = true;
+    }
+    for (int f = 0; f < func_count; f++) {
+        if (!bcIsKernel(&funcs[f])) continue;
+        uses_kernels = true;
+        if (funcs[f].reductions > max_reductions) max_reductions = funcs[f].reductions;
+    }
+}
+
+// C Generation
+//=======================
+// Stack entry k of the current region is the local s<k>, locals of a frame
+// are l<k>, and mem is one static array shared with the subroutines. Each
+// subroutine becomes a C function taking its arguments as s0..s<n-1> plus
+// the stack depth below them, which keeps the VM's overflow checks exact.
+// A PARALLEL FOR kernel is called once per iteration from a plain loop: the
+// compiled program runs it on one thread, folding reductions into acc in
+// iteration order, which gives the same results as the VM's thread pool.
+
+// String heap of the VM: pool records are emitted as a byte array, arena
+// records are bump allocated, and the operations are the VM's own from
+// Common/bytecode.h
+static const char* string_globals =
+    "static char* arena = NULL;\n"
+    "static uint32_t arena_used = 0;\n"
+    "static uint32_t arena_capacity = 0;\n"
+    "static long long inline_strings = 0;\n"
+    "static long long arena_strings = 0;\n"
+    "\n"
+    "static void growArena(uint32_t needed) {\n"
+    "    while (needed > arena_capacity) arena_capacity = arena_capacity ? arena_capacity * 2 : 64 * 1024;\n"
+    "    arena = realloc(arena, arena_capacity);\n"
+    "    if (!arena) {\n"
+    "        printf(\"Out of memory!\\n\");\n"
+    "        exit(1);\n"
+    "    }\n"
+    "}\n\n";
+
+static const char* string_output =
+    "static void outputString(int32_t h) {\n"
+    "    char buf[BC_STR_INLINE_MAX];\n"
+    "    int len;\n"
+    "    const char* bytes = stringBytes(h, &len, buf);\n"
+    "    fwrite(bytes, 1, len, stdout);\n"
+    "    putchar('\\n');\n"
+    "}\n\n";
+
+void emitPrelude(FILE* out, const char* source) {
+    fprintf(out, "// Generated by mainaot from %s\n", source);
+    fprintf(out, "#include <stdio.h>\n#include <stdlib.h>\n#include <string.h>\n#include <stdint.h>\n#include <signal.h>\n\n");
+    fprintf(out, "#define STACK_SIZE %d\n#define CALL_DEPTH %d\n#define LOCALS_SIZE %d\n", STACK_SIZE, CALL_DEPTH, LOCALS_SIZE);
+    fprintf(out, "#define MAX_FRAME_DEPTH %d\n\n", max_frame_depth);
+    fprintf(out, "static int32_t mem[%d];\n", mem_size);
+    if (func_count) {
+        fprintf(out, "static int frames = 0;\nstatic int locals_used = 0;\n\n");
+        fprintf(out, "static void callOverflow(void) {\n    printf(\"Call stack overflow!\\n\");\n    exit(1);\n}\n\n");
+    }
+    if (uses_kernels) fprintf(out, "static int32_t acc[%d];\n\n", max_reductions ? max_reductions : 1);
+    if (uses_bounds) {
+        fprintf(out, "static void boundFail(void) {\n    printf(\"Array index out of range!\\n\");\n    exit(1);\n}\n\n");
+    }
+    if (uses_divide) {
+        fputs(BC_DIVIDE(BC_AS_TEXT), out);
+        fputs("\n", out);
+    }
+    if (!uses_strings) return;
+    fprintf(out, "static const unsigned char pool_bytes[%u] = {", pool_size ? pool_size : 1);
+    for (uint32_t i = 0; i < pool_size; i++) {
+        fprintf(out, "%s%d,", i % 16 ? "" : "\n    ", (unsigned char)pool[i]);
+    }
+    fprintf(out, "\n};\nstatic const char* str_pool = (const char*)pool_bytes;\n");
+    fprintf(out, "static const uint32_t str_pool_size = %uu;\n", pool_size);
+    fputs(string_globals, out);
+    fputs(BC_STRING_FORMAT(BC_AS_TEXT), out);
+    fputs(BC_STRING_RUNTIME(BC_AS_TEXT), out);
+    fputs("\n", out);
+    fputs(string_output, out);
+}
+
+void emitSignature(FILE* out, const BcFunction* fn) {
+    fprintf(out, "static %s sub%d(int base", fn->returns ? "int32_t" : "void", fn->pc);
+    for (int i = 0; i < fn->nargs; i++) fprintf(out, ", int32_t s%d", i);
+    fprintf(out, ")");
+}
+
+void emitCall(FILE* out, int depth, const BcFunction* callee) {
+    int first = depth - callee->nargs;
+    fprintf(out, "    ");
+    if (callee->returns) fprintf(out, "s%d = ", first);
+    fprintf(out, "sub%d(base + %d", callee->pc, first);
+    for (int i = 0; i < callee->nargs; i++) fprintf(out, ", s%d", first + i);
+    fprintf(out, ");\n");
+}
+
+// Each iteration starts a fresh VM stack, so the kernel's base is 0
+void emitParallelFor(FILE* out, int depth, const BcFunction* kernel) {
+    int first = depth - kernel->nargs - 1;
+    const OpCode* ops = reduce_ops[kernel - funcs];
+    for (int k = 0; k < kernel->reductions; k++) {
+        fprintf(out, "    acc[%d] = %s;\n", k, ops[k] == OP_RMIN ? "INT32_MAX" : ops[k] == OP_RMAX ? "INT32_MIN" : "0");
+    }
+    fprintf(out, "    for (int64_t i = s%d; i <= s%d; i++) sub%d(0, (int32_t)i", first, first + 1, kernel->pc);
+    for (int i = 2; i <= kernel->nargs; i++) fprintf(out, ", s%d", first + i);
+    fprintf(out, ");\n");
+}
+
+// Emits instructions [pc, end) after declaring the stack entries they use;
+// locals is the frame size of the subroutine fn, 0 for main
+const BcFunction* loop_kernel = NULL;   // last PFOR emitted, for MERGE
+
+void emitBody(FILE* out, int pc, int end, const BcFunction* fn, int locals) {
+    int peak = 0;
+    for (int p = pc; p < end; p++) {
+        int op = program[p].op;
+        int after = depth_at[p] + (op == OP_PUSH || op == OP_LOAD || op == OP_LOADL);
+        if (after > peak) peak = after;
+    }
+    for (int k = fn ? fn->nargs : 0; k < peak; k++) fprintf(out, "    int32_t s%d;\n", k);
+    for (; pc < end; pc++) {
+        Instr in = program[pc];
+        int d = depth_at[pc];
+        switch (in.op) {
+            case OP_PUSH: fprintf(out, "    s%d = %d;\n", d, in.arg); break;
+            case OP_LOAD: fprintf(out, "    s%d = mem[%d];\n", d, in.arg); break;
+            case OP_STORE: fprintf(out, "    mem[%d] = s%d;\n", in.arg, d - 1); break;
+            case OP_LOADL: fprintf(out, "    s%d = l%d;\n", d, in.arg); break;
+            case OP_STOREL: fprintf(out, "    l%d = s%d;\n", in.arg, d - 1); break;
+            // through uint32_t so overflow wraps as in the VM instead of
+            // being undefined behaviour the C compiler may exploit
+            case OP_ADD: fprintf(out, "    s%d = (int32_t)((uint32_t)s%d + (uint32_t)s%d);\n", d - 2, d - 2, d - 1); break;
+            case OP_SUB: fprintf(out, "    s%d = (int32_t)((uint32_t)s%d - (uint32_t)s%d);\n", d - 2, d - 2, d - 1); break;
+            case OP_MUL: fprintf(out, "    s%d = (int32_t)((uint32_t)s%d * (uint32_t)s%d);\n", d - 2, d - 2, d - 1); break;
+            case OP_DIV: fprintf(out, "    s%d = bcDivide(s%d, s%d);\n", d - 2, d - 2, d - 1); break;
+            case OP_MULHI:
+                fprintf(out, "    s%d = (int32_t)(((int64_t)s%d * s%d) >> 32);\n", d - 2, d - 2, d - 1);
+                break;
+            // counts mod 32, as in the VM
+            case OP_SHL: fprintf(out, "    s%d = (int32_t)((uint32_t)s%d << (s%d & 31));\n", d - 2, d - 2, d - 1); break;
+            case OP_SHR: fprintf(out, "    s%d = (int32_t)((uint32_t)s%d >> (s%d & 31));\n", d - 2, d - 2, d - 1); break;
+            case OP_SAR: fprintf(out, "    s%d = s%d >> (s%d & 31);\n", d - 2, d - 2, d - 1); break;
+            case OP_LOADX: fprintf(out, "    s%d = mem[%d + s%d];\n", d - 1, in.arg, d - 1); break;
+            case OP_STOREX: fprintf(out, "    mem[%d + s%d] = s%d;\n", in.arg, d - 1, d - 2); break;
+            case OP_BOUND: fprintf(out, "    if ((uint32_t)s%d >= %uu) boundFail();\n", d - 1, (uint32_t)in.arg); break;
+            case OP_OUT: fprintf(out, "    printf(\"%%d\\n\", s%d);\n", d - 1); break;
+            case OP_CONCAT: fprintf(out, "    s%d = concatStrings(s%d, s%d);\n", d - 2, d - 2, d - 1); break;
+            case OP_OUTS: fprintf(out, "    outputString(s%d);\n", d - 1); break;
+            case OP_CALL: emitCall(out, d, bcFunctionAt(funcs, func_count, in.arg)); break;
+            case OP_ENTER: break;   // locals are declared above
+            case OP_SNAP: break;    // snapshots are a VM feature
+            case OP_PFOR:
+                loop_kernel = bcFunctionAt(funcs, func_count, in.arg);
+                emitParallelFor(out, d, loop_kernel);
+                break;
+            case OP_RSUM:
+                fprintf(out, "    acc[%d] = (int32_t)((uint32_t)acc[%d] + (uint32_t)s%d);\n", in.arg, in.arg, d - 1);
+                break;
+            case OP_RMIN: fprintf(out, "    if (s%d < acc[%d]) acc[%d] = s%d;\n", d - 1, in.arg, in.arg, d - 1); break;
+            case OP_RMAX: fprintf(out, "    if (s%d > acc[%d]) acc[%d] = s%d;\n", d - 1, in.arg, in.arg, d - 1); break;
+            case OP_MERGE:
+                switch (reduce_ops[loop_kernel - funcs][in.arg]) {
+                    case OP_RSUM:
+                        fprintf(out, "    s%d = (int32_t)((uint32_t)s%d + (uint32_t)acc[%d]);\n", d - 1, d - 1, in.arg);
+                        break;
+                    case OP_RMIN: fprintf(out, "    if (acc[%d] < s%d) s%d = acc[%d];\n", in.arg, d - 1, d - 1, in.arg); break;
+                    case OP_RMAX: fprintf(out, "    if (acc[%d] > s%d) s%d = acc[%d];\n", in.arg, d - 1, d - 1, in.arg); break;
+                    default: break;     // never folded, so still the identity
+                }
+                break;
+            case OP_RET:
+                fprintf(out, "    frames--;\n    locals_used -= %d;\n", locals);
+                if (fn->returns) fprintf(out, "    return s%d;\n", d - 1);
+                break;
+            case OP_END: break;
+        }
+    }
+}
+
+// Straight-line main code is cut where the stack is empty, so each part
+// stays small enough for the C compiler to optimize quickly
+int emitMain(FILE* out) {
+    int parts = 0;
+    int pc = 0;
+    while (program[pc].op != OP_END) {
+        int start = pc;
+        do {
+            pc++;
+        } while (program[pc].op != OP_END && (pc - start < CHUNK_INSTRS || depth_at[pc] != 0));
+        fprintf(out, "static void part%d(void) {\n    const int base = 0;\n    (void)base;\n", parts++);
+        emitBody(out, start, pc, NULL, 0);
+        fprintf(out, "}\n\n");
+    }
+    fprintf(out, "int main(void) {\n    (void)mem;\n");
+    for (int i = 0; i < parts; i++) fprintf(out, "    part%d();\n", i);
+    fprintf(out, "    return 0;\n}\n\n");
+    return pc + 1;
+}
+
+int emitSubroutine(FILE* out, int pc, const BcFunction* fn) {
+    int end = pc;
+    while (program[end].op != OP_RET) end++;
+    int locals = program[pc].arg;
+    emitSignature(out, fn);
+    fprintf(out, " {\n");
+    for (int k = 0; k < locals; k++) fprintf(out, "    int32_t l%d = 0;\n", k);
+    fprintf(out, "    if (frames == CALL_DEPTH || base + %d + MAX_FRAME_DEPTH >= STACK_SIZE) callOverflow();\n", fn->nargs);
+    fprintf(out, "    if (%d > LOCALS_SIZE - locals_used) callOverflow();\n", locals);
+    fprintf(out, "    frames++;\n    locals_used += %d;\n", locals);
+    emitBody(out, pc, end + 1, fn, locals);
+    fprintf(out, "}\n\n");
+    return end + 1;
+}
+
+void emitProgram(FILE* out, const char* source) {
+    emitPrelude(out, source);
+    for (int f = 0; f < func_count; f++) {
+        emitSignature(out, &funcs[f]);
+        fprintf(out, ";\n");
+    }
+    if (func_count) fprintf(out, "\n");
+    int pc = emitMain(out);
+    for (int f = 0; f < func_count; f++) {
+        pc = emitSubroutine(out, pc, &funcs[f]);
+    }
+}
+
+// Builds the C file with $CC (default cc) and $CFLAGS (default -O2)
+int buildExecutable(const char* c_path, const char* exe_path) {
+    const char* cc = getenv("CC");
+    const char* cflags = getenv("CFLAGS");
+    if (!cc || !*cc) cc = "cc";
+    if (!cflags) cflags = "-O2";
+    size_t size = strlen(cc) + strlen(cflags) + strlen(c_path) + strlen(exe_path) + 32;
+    char* command = malloc(size);
+    snprintf(command, size, "%s %s -o \"%s\" \"%s\"", cc, cflags, exe_path, c_path);
+    int status = system(command);
+    if (status != 0) {
+        printf("Error: %s failed\n", command);
+        free(command);
+        return 1;
+    }
+    free(command);
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    char* path = NULL;
+    char* c_path = NULL;
+    char* exe_path = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-o") && i + 1 < argc) {
+            exe_path = argv[++i];
+        } else if (!path) {
+            path = argv[i];
+        } else {
+            c_path = argv[i];
+        }
+    }
+    if (!path || !c_path) {
+        printf("Usage: %s <program.pseubc> <output.c> [-o <executable>]\n", argv[0]);
+        return 1;
+    }
+
+    FILE* fp = fopen(path, "rb");
+    if (!fp) {
+        printf("Error: Cannot open %s\n", path);
+        return 1;
+    }
+    char magic[BC_MAGIC_LEN];
+    if (fread(magic, 1, BC_MAGIC_LEN, fp) == BC_MAGIC_LEN && memcmp(magic, BC_MAGIC, BC_MAGIC_LEN) == 0) {
+        loadBinary(fp);
+    } else {
+        fclose(fp);
+        fp = fopen(path, "r");
+        loadText(fp);
+    }
+    fclose(fp);
+    analyzeProgram();
+
+    FILE* out = fopen(c_path, "w");
+    if (!out) {
+        printf("Error: Cannot create %s\n", c_path);
+        return 1;
+    }
+    emitProgram(out, path);
+    fclose(out);
+    if (exe_path) return buildExecutable(c_path, exe_path);
+    return 0;
+}
@@ -5,6 +5,9 @@
 #include <string.h>
 #include <stdbool.h>
 
+#include "../Common/bytecode.h"
+#include "../Common/stats.h"
+
 typedef enum Token {
     IDENTIFIER,
     ASSIGNMENT,
@@ -13,7 +16,12 @@ typedef enum Token {
     OUT,
     IDENTIFIER_NUM,
     _NULL,
-    END
+    END,
+    ARRAY_REF,
+    LBRACKET,
+    RBRACKET,
+    UNCHECKED,
+    OUTS
 } Token;
 
 typedef enum Oper {
@@ -21,6 +29,7 @@ typedef enum Oper {
     SUB,
     MUL,
     DIV,
+    CAT,
     NONE
 } Oper;
 
@@ -79,8 +88,8 @@ bool isIdentifier(char* literal) {
 }
 
 bool isOper(char literal) {
-    const char opers[] = {'+', '-', '*', '/'};
-    for (int i = 0; i < 4; i++) {
+    const char opers[] = {'+', '-', '*', '/', '&'};
+    for (int i = 0; i < 5; i++) {
         if (opers[i] == literal) {
             return true;
         }
@@ -92,12 +101,16 @@ Oper operType(char literal) {
     else if (literal == '-') {return SUB;}
     else if (literal == '/') {return DIV;}
     else if (literal == '*') {return MUL;}
+    else if (literal == '&') {return CAT;}
     return NONE;
 }
 
 bool isNumber(char* literal) {
     int len = strlen(literal);
-    for (int i = 0; i < len; i++) {
+    if (len == 0 || (literal[0] == '-' && len == 1)) {
+        return false;
+    }
+    for (int i = (literal[0] == '-') ? 1 : 0; i < len; i++) {
         if (!(literal[i] >= '0' && literal[i] <= '9')) {
             return false;
         }
@@ -108,6 +121,14 @@ bool isNumber(char* literal) {
 char **symbols = NULL;
 int symbols_len = 0;
 
+// Symbols own a run of mem slots: one for scalars, the whole element range
+// for arrays. Array storage starts on a 64-byte (16-slot) boundary.
+int *symbol_slots = NULL;
+int *symbol_lower = NULL;
+int *symbol_length = NULL;     // 0 for scalars
+int slots_used = 0;
+bool has_arrays = false;
+
 int checkSymbol(char* literal) {
     for (int i = 0; i < symbols_len; i++) {
         if (!(strcmp(literal, symbols[i]))) {
@@ -126,16 +147,230 @@ bool addSymbol(char* literal) {
     if (!symbols[symbols_len]) return false;
 
     strcpy(symbols[symbols_len], literal);
+    symbol_slots = realloc(symbol_slots, sizeof(int) * (symbols_len + 1));
+    symbol_lower = realloc(symbol_lower, sizeof(int) * (symbols_len + 1));
+    symbol_length = realloc(symbol_length, sizeof(int) * (symbols_len + 1));
+    symbol_slots[symbols_len] = slots_used++;
+    symbol_lower[symbols_len] = 0;
+    symbol_length[symbols_len] = 0;
     symbols_len++;
     return true;
 }
 
+bool addArray(char* literal, int lower, int upper) {
+    if (checkSymbol(literal) != -1) {
+        printf("Array %s redeclared!\n", literal);
+        exit(1);
+    }
+    if (!addSymbol(literal)) return false;
+    int idx = symbols_len - 1;
+    // replace the single slot addSymbol reserved with an aligned run
+    symbol_slots[idx] = (symbol_slots[idx] + 15) & ~15;
+    symbol_lower[idx] = lower;
+    symbol_length[idx] = upper - lower + 1;
+    slots_used = symbol_slots[idx] + symbol_length[idx];
+    has_arrays = true;
+    return true;
+}
+
+// Subroutines
+//=======================
+// Inside a function or procedure every scalar is a local of its frame,
+// numbered from 0 with the parameters first; arrays stay global. A kernel
+// (PARALLEL FOR body) is a procedure whose header also counts reductions.
+bool in_function = false;
+bool function_returns = false;
+bool function_kernel = false;
+int function_reductions = 0;
+char function_name[256];
+int function_args = 0;
+char** locals = NULL;
+int locals_len = 0;
+FILE* body_file = NULL;         // body of the open subroutine, see EndFunction
+FILE* function_file = NULL;     // finished subroutines, appended after END
+
+int localSlot(char* literal) {
+    for (int i = 0; i < locals_len; i++) {
+        if (!strcmp(literal, locals[i])) {
+            return i;
+        }
+    }
+    locals = realloc(locals, sizeof(char*) * (locals_len + 1));
+    locals[locals_len] = malloc(strlen(literal) + 1);
+    strcpy(locals[locals_len], literal);
+    return locals_len++;
+}
+
+// Writes the operand string for an identifier into str.
+Token resolveIdentifier(char* literal, char* str) {
+    int sym = checkSymbol(literal);
+    if (sym != -1 && symbol_length[sym] > 0) {
+        // arrays are addressed through their symbol index
+        sprintf(str, "%d", sym);
+        return ARRAY_REF;
+    }
+    if (in_function) {
+        sprintf(str, "$%d", localSlot(literal));
+        return IDENTIFIER;
+    }
+    if (sym == -1) {
+        addSymbol(literal);
+        sym = symbols_len - 1;
+    }
+    sprintf(str, "[%d]", symbol_slots[sym]);
+    return IDENTIFIER;
+}
+
+void copyFile(FILE* from, FILE* to) {
+    char buf[4096];
+    size_t n;
+    rewind(from);
+    while ((n = fread(buf, 1, sizeof(buf), from)) > 0) {
+        fwrite(buf, 1, n, to);
+    }
+}
+
+// Reads a line of any length into *line, growing it; false at end of file
+bool readLine(FILE* fp, char** line, size_t* capacity) {
+    size_t len = 0;
+    if (!*line) {
+        *capacity = 512;
+        *line = malloc(*capacity);
+    }
+    while (fgets(*line + len, (int)(*capacity - len), fp)) {
+        len += strlen(*line + len);
+        if ((*line)[len - 1] == '\n') return true;
+        *capacity *= 2;
+        *line = realloc(*line, *capacity);
+    }
+    return len > 0;
+}
+
+// Splits a copy of statement into words; IRGen puts no limit on argument
+// lists, so both are sized to the statement. The caller frees *copy and
+// *words.
+int splitWords(char* statement, char** copy, char*** words) {
+    *copy = _strdup(statement);
+    *words = malloc(sizeof(char*) * (strlen(statement) / 2 + 1));
+    int count = 0;
+    for (char* w = strtok(*copy, " \n"); w; w = strtok(NULL, " \n")) {
+        (*words)[count++] = w;
+    }
+    return count;
+}
+
+// "function name param...", "procedure name param..." or
+// "kernel name reductions param..."
+void BeginFunction(char* statement) {
+    char* copy = _strdup(statement);
+    char* kind = strtok(copy, " \n");
+    char* name = strtok(NULL, " \n");
+    char* reductions = name && !strcmp(kind, "kernel") ? strtok(NULL, " \n") : NULL;
+    if (in_function || !name || (!strcmp(kind, "kernel") && !reductions)) {
+        printf("Invalid subroutine header: %s", statement);
+        exit(1);
+    }
+    function_returns = !strcmp(kind, "function");
+    function_kernel = reductions != NULL;
+    function_reductions = reductions ? atoi(reductions) : 0;
+    strcpy(function_name, name);
+    for (int i = 0; i < locals_len; i++) {
+        free(locals[i]);
+    }
+    locals_len = 0;
+    for (char* param = strtok(NULL, " \n"); param; param = strtok(NULL, " \n")) {
+        localSlot(param);
+    }
+    free(copy);
+    function_args = locals_len;
+    in_function = true;
+    body_file = tmpfile();
+}
+
+// The frame size is only known once the body has been read, so the body is
+// buffered and written behind its FUNC/ENTER prologue here.
+void EndFunction(void) {
+    if (!function_file) {
+        function_file = tmpfile();
+    }
+    if (function_kernel) {
+        fprintf(function_file, "KERNEL %s #%d #%d\n", function_name, function_args, function_reductions);
+    } else {
+        fprintf(function_file, "FUNC %s #%d #%d\n", function_name, function_args, function_returns ? 1 : 0);
+    }
+    fprintf(function_file, "ENTER #%d\n", locals_len);
+    // arguments were pushed left to right
+    for (int i = function_args - 1; i >= 0; i--) {
+        fprintf(function_file, "STORE $%d\n", i);
+    }
+    copyFile(body_file, function_file);
+    if (!function_returns) {
+        fprintf(function_file, "RET\n");
+    }
+    fclose(body_file);
+    body_file = NULL;
+    in_function = false;
+}
+
+// String constants
+//=======================
+// Literals of up to three bytes become inline handles; longer ones are
+// interned into the constant pool once and referenced by handle.
+char** string_texts = NULL;
+int32_t* string_handles = NULL;
+int string_count = 0;
+uint32_t pool_used = 0;
+
+int32_t internString(char* text) {
+    for (int i = 0; i < string_count; i++) {
+        if (!strcmp(text, string_texts[i])) {
+            return string_handles[i];
+        }
+    }
+    int len = strlen(text);
+    string_texts = realloc(string_texts, sizeof(char*) * (string_count + 1));
+    string_handles = realloc(string_handles, sizeof(int32_t) * (string_count + 1));
+    string_texts[string_count] = malloc(len + 1);
+    strcpy(string_texts[string_count], text);
+    if (len <= BC_STR_INLINE_MAX) {
+        string_handles[string_count] = bcInlineString(text, len);
+    } else {
+        string_handles[string_count] = bcStringHandle(pool_used, BC_STR_POOL);
+        pool_used += bcRecordSize(len);
+    }
+    return string_handles[string_count++];
+}
+
+// place constants interned since known_strings in the pool
+void EchoStringConsts(FILE* bc_file, int known_strings) {
+    for (int i = known_strings; i < string_count; i++) {
+        if ((string_handles[i] & 1) == 0) continue;
+        fprintf(bc_file, "CONST #%d \"%s\"\n", string_handles[i], string_texts[i]);
+    }
+}
+
 Statement TokenizeStatement(char* statement) {
     int statement_len = strlen(statement);
     Statement tokenized_statement;
     int right = 0, left = 0, i = 0, len = strlen(statement);
     while (left <= len && right <= len) {
-        if (isOper(statement[right])) {
+        if (statement[right] == '"' && left == right) {
+            // the literal, spaces included, becomes its handle
+            char* close = strchr(statement + right + 1, '"');
+            if (!close) {
+                printf("Unterminated string: %s", statement);
+                exit(1);
+            }
+            char* text = slice(statement, right + 1, (int)(close - statement) - 1);
+            tokenized_statement.tokens[i] = NUMBER;
+            sprintf(tokenized_statement.str_tokens[i], "#%d", internString(text));
+            free(text);
+            i++;
+            left = right = (int)(close - statement) + 1;
+            continue;
+        }
+        // a '-' glued to a digit is the sign of a folded constant, not SUB
+        if (isOper(statement[right]) && !(statement[right] == '-' && statement[right + 1] >= '0' && statement[right + 1] <= '9')) {
             tokenized_statement.tokens[i] = OPER;
             char oper_str[2]; oper_str[1] = '\0';
             oper_str[0] = statement[right];
@@ -167,17 +402,29 @@ Statement TokenizeStatement(char* statement) {
                 tokenized_statement.tokens[i] = OUT,
                 strcpy(tokenized_statement.str_tokens[i], "output");
             }
+            else if (!(strcmp("outputs", substr))) {
+                tokenized_statement.tokens[i] = OUTS,
+                strcpy(tokenized_statement.str_tokens[i], "outputs");
+            }
             else if (!(strcmp("null", substr))) {
                 tokenized_statement.tokens[i] = _NULL,
                 strcpy(tokenized_statement.str_tokens[i], "null");
             }
+            else if (!(strcmp("[", substr))) {
+                tokenized_statement.tokens[i] = LBRACKET;
+                strcpy(tokenized_statement.str_tokens[i], "[");
+            }
+            else if (!(strcmp("]", substr))) {
+                tokenized_statement.tokens[i] = RBRACKET;
+                strcpy(tokenized_statement.str_tokens[i], "]");
+            }
+            else if (!(strcmp("unchecked", substr))) {
+                tokenized_statement.tokens[i] = UNCHECKED;
+                strcpy(tokenized_statement.str_tokens[i], "unchecked");
+            }
             else if (isIdentifier(substr)) {
-                if (checkSymbol(substr) == -1) {
-                    addSymbol(substr);
-                }
                 char str[256];
-                sprintf(str, "[%d]", checkSymbol(substr));
-                tokenized_statement.tokens[i] = IDENTIFIER;
+                tokenized_statement.tokens[i] = resolveIdentifier(substr, str);
                 strcpy(tokenized_statement.str_tokens[i], str);
             }
             else {}
@@ -198,6 +445,10 @@ Statement TokenizeStatement(char* statement) {
 Token gs1[] = {IDENTIFIER, ASSIGNMENT, IDENTIFIER_NUM, END};
 Token gs2[] = {IDENTIFIER, ASSIGNMENT, IDENTIFIER_NUM, OPER, IDENTIFIER_NUM, END};
 Token gs3[] = {OUT, IDENTIFIER_NUM, END};
+// followed by END or UNCHECKED
+Token gs4[] = {IDENTIFIER, ASSIGNMENT, ARRAY_REF, LBRACKET, IDENTIFIER_NUM, RBRACKET};
+Token gs5[] = {ARRAY_REF, LBRACKET, IDENTIFIER_NUM, RBRACKET, ASSIGNMENT, IDENTIFIER_NUM};
+Token gs6[] = {OUTS, IDENTIFIER_NUM, END};
 
 char* mapOperBC(Oper oper) {
     switch (oper) {
@@ -205,38 +456,501 @@ char* mapOperBC(Oper oper) {
         case SUB: return "SUB";
         case DIV: return "DIV";
         case MUL: return "MUL";
+        case CAT: return "CONCAT";
         default:  return "NONE";
     }
 }
 
+int optLevel = 0;
+
+// Strength Reduction
+//=======================
+// Division by a constant becomes a multiply-high by a magic number plus
+// shifts (Hacker's Delight, 10-1); results match C truncating division.
+typedef struct MagicDiv {
+    int M;
+    int s;
+} MagicDiv;
+
+// d must be >= 2
+MagicDiv magicDiv(int d) {
+    const unsigned int two31 = 0x80000000u;
+    unsigned int ad = (unsigned int)d;
+    unsigned int anc = two31 - 1 - two31 % ad;
+    unsigned int q1 = two31 / anc, r1 = two31 - q1 * anc;
+    unsigned int q2 = two31 / ad, r2 = two31 - q2 * ad;
+    unsigned int delta;
+    int p = 31;
+    do {
+        p++;
+        q1 *= 2; r1 *= 2;
+        if (r1 >= anc) { q1++; r1 -= anc; }
+        q2 *= 2; r2 *= 2;
+        if (r2 >= ad) { q2++; r2 -= ad; }
+        delta = ad - r2;
+    } while (q1 < delta || (q1 == delta && r1 == 0));
+    MagicDiv mag;
+    mag.M = (int)(q2 + 1);
+    mag.s = p - 32;
+    return mag;
+}
+
+int log2Exact(int value) {
+    if (value <= 0 || (value & (value - 1))) {
+        return -1;
+    }
+    int k = 0;
+    while ((1 << k) != value) {
+        k++;
+    }
+    return k;
+}
+
+bool constOperand(char* operand, int* value) {
+    if (operand[0] != '#') {
+        return false;
+    }
+    *value = atoi(operand + 1);
+    return true;
+}
+
+// n / d for 2 <= d <= 2^31 - 1; negative divisors are negated by the caller
+void EchoDivConst(FILE* bc_file, char* n, int d) {
+    int k = log2Exact(d);
+    if (k > 0) {
+        // bias negative dividends by d - 1 so the shift truncates toward zero
+        fprintf(bc_file, "PUSH %s\nPUSH %s\nPUSH #31\nSAR\nPUSH #%d\nSHR\nADD\nPUSH #%d\nSAR\n", n, n, 32 - k, k);
+        return;
+    }
+    MagicDiv mag = magicDiv(d);
+    fprintf(bc_file, "PUSH %s\nPUSH #%d\nMULHI\n", n, mag.M);
+    if (mag.M < 0) {
+        fprintf(bc_file, "PUSH %s\nADD\n", n);
+    }
+    if (mag.s > 0) {
+        fprintf(bc_file, "PUSH #%d\nSAR\n", mag.s);
+    }
+    fprintf(bc_file, "PUSH %s\nPUSH #31\nSHR\nADD\n", n);
+}
+
+// Emits lhs op rhs without DIV/MUL when rhs (or either side of MUL) is a
+// constant that allows it: any divisor except 0, -1 and INT_MIN, and a
+// multiplier of 0, 1 or a power of two. Returns false if the generic
+// sequence is needed.
+bool EchoStrengthReduced(FILE* bc_file, Oper op, char* lhs, char* rhs) {
+    int c;
+    if (op == MUL) {
+        char* n = lhs;
+        if (!constOperand(rhs, &c)) {
+            if (!constOperand(lhs, &c)) {
+                return false;
+            }
+            n = rhs;
+        }
+        if (c == 0) {
+            fprintf(bc_file, "PUSH #0\n");
+        } else if (c == 1) {
+            fprintf(bc_file, "PUSH %s\n", n);
+        } else if (log2Exact(c) > 0) {
+            fprintf(bc_file, "PUSH %s\nPUSH #%d\nSHL\n", n, log2Exact(c));
+        } else {
+            return false;
+        }
+        return true;
+    }
+    if (op == DIV && constOperand(rhs, &c)) {
+        // 0, -1 and INT_MIN keep the hardware divide and its traps
+        if (c == 0 || c == -1 || c == (-2147483647 - 1)) {
+            return false;
+        }
+        if (c == 1) {
+            fprintf(bc_file, "PUSH %s\n", lhs);
+        } else if (c > 0) {
+            EchoDivConst(bc_file, lhs, c);
+        } else {
+            // truncation is symmetric: n / -d == -(n / d)
+            fprintf(bc_file, "PUSH #0\n");
+            EchoDivConst(bc_file, lhs, -c);
+            fprintf(bc_file, "SUB\n");
+        }
+        return true;
+    }
+    return false;
+}
+
+// Arrays
+//=======================
+// A constant index is resolved to its slot here and *slot is set. Otherwise
+// the zero-based index is left on the stack, bounds-checked unless IRGen
+// proved it in range, and -1 is stored in *slot.
+void EchoIndex(FILE* bc_file, int array, char* index, bool checked, int* slot) {
+    int lower = symbol_lower[array], length = symbol_length[array];
+    int k;
+    if (constOperand(index, &k)) {
+        if (k < lower || k - lower >= length) {
+            printf("Array index %d out of range for %s!\n", k, symbols[array]);
+            exit(1);
+        }
+        *slot = symbol_slots[array] + (k - lower);
+        return;
+    }
+    *slot = -1;
+    fprintf(bc_file, "PUSH %s\n", index);
+    if (lower != 0) {
+        fprintf(bc_file, "PUSH #%d\nSUB\n", lower);
+    }
+    if (checked) {
+        fprintf(bc_file, "BOUND #%d\n", length);
+    }
+}
+
+// name new slots in a comment so the VM can bind batch input columns
+void EchoSlotNames(FILE* bc_file, int known_symbols) {
+    for (int i = known_symbols; i < symbols_len; i++) {
+        fprintf(bc_file, "; [%d] %s\n", symbol_slots[i], symbols[i]);
+    }
+}
+
+char* operandBC(char* word, char* str) {
+    if (isNumber(word)) {
+        sprintf(str, "#%s", word);
+    } else if (resolveIdentifier(word, str) == ARRAY_REF) {
+        printf("Array %s passed as a value!\n", word);
+        exit(1);
+    }
+    return str;
+}
+
+// "[dst =] call name arg..." and "return value"; false for other statements
+bool echoCallWords(FILE* bc_file, char** words, int count, char (*str)[256]) {
+    int known_symbols = symbols_len;
+    if (count == 2 && !strcmp(words[0], "return")) {
+        fprintf(bc_file, "PUSH %s\nRET\n", operandBC(words[1], str[0]));
+        return true;
+    }
+    int first = (count >= 3 && !strcmp(words[1], "=")) ? 2 : 0;
+    if (count < first + 2 || strcmp(words[first], "call")) {
+        return false;
+    }
+    for (int i = first + 2; i < count; i++) {
+        operandBC(words[i], str[i]);
+    }
+    if (first) {
+        operandBC(words[0], str[0]);
+    }
+    EchoSlotNames(bc_file, known_symbols);
+    for (int i = first + 2; i < count; i++) {
+        fprintf(bc_file, "PUSH %s\n", str[i]);
+    }
+    fprintf(bc_file, "CALL %s\n", words[first + 1]);
+    if (first) {
+        fprintf(bc_file, "STORE %s\n", str[0]);
+    }
+    return true;
+}
+
+// "pfor name first last shared...", "reduce kind k value" and
+// "dst = merge k value"; false for other statements
+bool echoParallelWords(FILE* bc_file, char** words, int count, char (*str)[256]) {
+    int known_symbols = symbols_len;
+    if (count >= 4 && !strcmp(words[0], "pfor")) {
+        for (int i = 2; i < count; i++) {
+            operandBC(words[i], str[i]);
+        }
+        EchoSlotNames(bc_file, known_symbols);
+        for (int i = 2; i < count; i++) {
+            fprintf(bc_file, "PUSH %s\n", str[i]);
+        }
+        fprintf(bc_file, "PFOR %s\n", words[1]);
+        return true;
+    }
+    if (count == 4 && !strcmp(words[0], "reduce")) {
+        const char* op = !strcmp(words[1], "sum") ? "RSUM" : !strcmp(words[1], "min") ? "RMIN" : "RMAX";
+        fprintf(bc_file, "PUSH %s\n%s #%d\n", operandBC(words[3], str[3]), op, atoi(words[2]));
+        return true;
+    }
+    if (count == 5 && !strcmp(words[1], "=") && !strcmp(words[2], "merge")) {
+        operandBC(words[4], str[4]);
+        operandBC(words[0], str[0]);
+        EchoSlotNames(bc_file, known_symbols);
+        fprintf(bc_file, "PUSH %s\nMERGE #%d\nSTORE %s\n", str[4], atoi(words[3]), str[0]);
+        return true;
+    }
+    return false;
+}
+
+// Runs echo over the words of statement with an operand buffer per word
+bool echoWords(FILE* bc_file, char* statement, bool (*echo)(FILE*, char**, int, char (*)[256])) {
+    char* copy;
+    char** words;
+    int count = splitWords(statement, &copy, &words);
+    char (*str)[256] = malloc(sizeof(*str) * (count + 1));
+    bool done = echo(bc_file, words, count, str);
+    free(str);
+    free(words);
+    free(copy);
+    return done;
+}
+
+// True if the statement is exactly word, not an identifier starting with it
+bool isDirective(char* statement, const char* word) {
+    size_t len = strlen(word);
+    return !strncmp(statement, word, len) && (statement[len] == '\n' || statement[len] == '\0');
+}
+
 void EchoBC(FILE* bc_file, char* statement) {
+    int known_symbols = symbols_len;
+    char array_name[256];
+    int lower, upper;
+    if (sscanf(statement, "array %255s %d %d", array_name, &lower, &upper) == 3) {
+        addArray(array_name, lower, upper);
+        return;
+    }
+    if (!strncmp(statement, "function ", 9) || !strncmp(statement, "procedure ", 10)
+        || !strncmp(statement, "kernel ", 7)) {
+        BeginFunction(statement);
+        return;
+    }
+    if (isDirective(statement, "endfunction") || isDirective(statement, "endprocedure")
+        || isDirective(statement, "endkernel")) {
+        EndFunction();
+        return;
+    }
+    if (isDirective(statement, "checkpoint")) {
+        if (in_function) {
+            printf("checkpoint inside subroutine %s\n", function_name);
+            exit(1);
+        }
+        fprintf(bc_file, "SNAP\n");
+        return;
+    }
+    if (in_function) {
+        bc_file = body_file;
+    }
+    if (echoWords(bc_file, statement, echoCallWords) || echoWords(bc_file, statement, echoParallelWords)) {
+        return;
+    }
+    int known_strings = string_count;
+    statsEnter("lex");
     Statement tokenized_statement = TokenizeStatement(statement);
+    statsEnter("emit");
+    EchoSlotNames(bc_file, known_symbols);
+    EchoStringConsts(bc_file, known_strings);
     if (checkGrammer(gs1, tokenized_statement.tokens, 4)) {
         fprintf(bc_file, "PUSH %s\nSTORE %s\n", tokenized_statement.str_tokens[2], tokenized_statement.str_tokens[0]);
     }
     else if (checkGrammer(gs2, tokenized_statement.tokens, 6)) {
-        fprintf(bc_file, "PUSH %s\nPUSH %s\n%s\nSTORE %s\n", tokenized_statement.str_tokens[2], tokenized_statement.str_tokens[4], mapOperBC(tokenized_statement.op), tokenized_statement.str_tokens[0]);
+        char* lhs = tokenized_statement.str_tokens[2];
+        char* rhs = tokenized_statement.str_tokens[4];
+        if (optLevel < 2 || !EchoStrengthReduced(bc_file, tokenized_statement.op, lhs, rhs)) {
+            fprintf(bc_file, "PUSH %s\nPUSH %s\n%s\n", lhs, rhs, mapOperBC(tokenized_statement.op));
+        }
+        fprintf(bc_file, "STORE %s\n", tokenized_statement.str_tokens[0]);
     }
     else if (checkGrammer(gs3, tokenized_statement.tokens, 3)) {
         fprintf(bc_file, "PUSH %s\nOUT\n", tokenized_statement.str_tokens[1]);
     }
+    else if (checkGrammer(gs6, tokenized_statement.tokens, 3)) {
+        fprintf(bc_file, "PUSH %s\nOUTS\n", tokenized_statement.str_tokens[1]);
+    }
+    else if (checkGrammer(gs4, tokenized_statement.tokens, 6)) {
+        int array = atoi(tokenized_statement.str_tokens[2]);
+        int slot;
+        EchoIndex(bc_file, array, tokenized_statement.str_tokens[4], tokenized_statement.tokens[6] != UNCHECKED, &slot);
+        if (slot >= 0) fprintf(bc_file, "PUSH [%d]\n", slot);
+        else fprintf(bc_file, "LOADX [%d]\n", symbol_slots[array]);
+        fprintf(bc_file, "STORE %s\n", tokenized_statement.str_tokens[0]);
+    }
+    else if (checkGrammer(gs5, tokenized_statement.tokens, 6)) {
+        int array = atoi(tokenized_statement.str_tokens[0]);
+        int slot;
+        fprintf(bc_file, "PUSH %s\n", tokenized_statement.str_tokens[5]);
+        EchoIndex(bc_file, array, tokenized_statement.str_tokens[2], tokenized_statement.tokens[6] != UNCHECKED, &slot);
+        if (slot >= 0) fprintf(bc_file, "STORE [%d]\n", slot);
+        else fprintf(bc_file, "STOREX [%d]\n", symbol_slots[array]);
+    }
 }
 
+// Assembles the text bytecode in bc_file into the binary format.
 void FinalizeBC(FILE* bc_file, FILE* out_file) {
+    BytecodeHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, BC_MAGIC, BC_MAGIC_LEN);
+    header.instr_offset = BC_PAGE_SIZE;
+
+    char page[BC_PAGE_SIZE] = {0};
+    fwrite(page, 1, BC_PAGE_SIZE, out_file);
+
+    char* names = NULL;
+    int names_size = 0;
+    int names_capacity = 0;
+    char* pool = NULL;
+    uint32_t pool_size = 0;
+    Instr* instrs = NULL;
+    char** callees = NULL;      // CALL operand names, resolved below
+    uint32_t instr_capacity = 0;
+    BcFunction* funcs = NULL;
+    char** func_names = NULL;
+    int func_count = 0;
+    char* line = NULL;
+    size_t line_capacity = 0;
+    rewind(bc_file);
+    while (readLine(bc_file, &line, &line_capacity)) {
+        Instr in;
+        int slot;
+        char* name = NULL;
+        BcFunction fn;
+        int kind = bcDecodeLine(line, &in, &slot, &name, &fn);
+        if (kind < 0) {
+            printf("Unknown instruction: %s\n", bcTrim(line));
+            exit(1);
+        }
+        if (kind == 3) {
+            fn.pc = header.instr_count;
+            funcs = realloc(funcs, sizeof(BcFunction) * (func_count + 1));
+            func_names = realloc(func_names, sizeof(char*) * (func_count + 1));
+            funcs[func_count] = fn;
+            func_names[func_count++] = _strdup(name);
+        }
+        if (slot >= 0) {
+            int32_t len = (int32_t)strlen(name);
+            while (names_size + 8 + len > names_capacity) {
+                names_capacity = names_capacity ? names_capacity * 2 : 4096;
+                names = realloc(names, names_capacity);
+            }
+            memcpy(names + names_size, &slot, 4);
+            memcpy(names + names_size + 4, &len, 4);
+            memcpy(names + names_size + 8, name, len);
+            names_size += 8 + len;
+        }
+        if (kind == 2) header.mem_size = in.arg;
+        if (kind == 4) {
+            uint32_t offset = (uint32_t)in.arg >> 2;
+            int32_t len = (int32_t)strlen(name);
+            if (offset + bcRecordSize(len) > pool_size) {
+                pool = realloc(pool, offset + bcRecordSize(len));
+                memset(pool + pool_size, 0, offset + bcRecordSize(len) - pool_size);
+                pool_size = offset + bcRecordSize(len);
+            }
+            memcpy(pool + offset, &len, 4);
+            memcpy(pool + offset + 4, name, len);
+        }
+        if (kind != 1) continue;
+        if (header.instr_count == instr_capacity) {
+            instr_capacity = instr_capacity ? instr_capacity * 2 : 1024;
+            instrs = realloc(instrs, sizeof(Instr) * instr_capacity);
+            callees = realloc(callees, sizeof(char*) * instr_capacity);
+        }
+        instrs[header.instr_count] = in;
+        callees[header.instr_count] = in.op == OP_CALL || in.op == OP_PFOR ? _strdup(name) : NULL;
+        header.instr_count++;
+    }
+    free(line);
+    for (uint32_t pc = 0; pc < header.instr_count; pc++) {
+        if (!callees[pc]) continue;
+        int f = 0;
+        while (f < func_count && strcmp(func_names[f], callees[pc])) f++;
+        if (f == func_count) {
+            printf("Call to undefined subroutine %s\n", callees[pc]);
+            exit(1);
+        }
+        instrs[pc].arg = funcs[f].pc;
+        free(callees[pc]);
+    }
+    fwrite(instrs, sizeof(Instr), header.instr_count, out_file);
 
+    header.pool_offset = header.instr_offset + header.instr_count * sizeof(Instr);
+    header.pool_size = pool_size;
+    fwrite(pool, 1, pool_size, out_file);
+    free(pool);
+
+    header.names_offset = header.pool_offset + pool_size;
+    header.names_size = names_size;
+    fwrite(names, 1, names_size, out_file);
+    header.funcs_offset = header.names_offset + names_size;
+    header.funcs_count = func_count;
+    fwrite(funcs, sizeof(BcFunction), func_count, out_file);
+    for (int f = 0; f < func_count; f++) free(func_names[f]);
+    free(func_names);
+    free(funcs);
+    free(callees);
+    free(instrs);
+    free(names);
+    rewind(out_file);
+    fwrite(&header, sizeof(header), 1, out_file);
 }
 
 int main(int argc, char* argv[]) {
-    FILE* bc_file = fopen(argv[2], "w");
-    FILE* ir_file = fopen(argv[1], "r");
-    char str[256];
-    while (fgets(str, 256, ir_file)) {
+    char* paths[2] = {NULL, NULL};
+    int path_count = 0;
+    bool binary = false;
+    bool stats_json = false;
+    for (int i = 1; i < argc; i++) {
+        if (!strncmp(argv[i], "-O", 2)) {
+            if (strlen(argv[i]) != 3 || argv[i][2] < '0' || argv[i][2] > '2') {
+                printf("Unknown optimization level: %s\n", argv[i]);
+                return 1;
+            }
+            optLevel = argv[i][2] - '0';
+        } else if (!strcmp(argv[i], "-b")) {
+            binary = true;
+        } else if (statsFlag(argv[i], &stats_json)) {
+            continue;
+        } else if (path_count < 2) {
+            paths[path_count++] = argv[i];
+        }
+    }
+    if (path_count < 2) {
+        printf("Usage: %s [-O0|-O1|-O2] [-b] [--stats[=json]] <input.pseuir|-> <output.pseubc>\n", argv[0]);
+        return 1;
+    }
+    FILE* ir_file = strcmp(paths[0], "-") ? fopen(paths[0], "r") : stdin;
+    if (!ir_file) {
+        perror("fopen");
+        return 1;
+    }
+    // binary output is assembled from the text form once it is complete
+    FILE* out_file = fopen(paths[1], binary ? "wb" : "w");
+    if (!out_file) {
+        perror("fopen");
+        return 1;
+    }
+    FILE* bc_file = binary ? tmpfile() : out_file;
+    static char sink[1 << 16];
+    setvbuf(bc_file, sink, _IOFBF, sizeof(sink));
+    char* str = NULL;
+    size_t str_capacity = 0;
+    statsEnter("read");
+    while (readLine(ir_file, &str, &str_capacity)) {
         if (strlen(str) > 1) {
+            statsEnter("emit");
             EchoBC(bc_file, str);
+            statsEnter("read");
         }
     }
+    free(str);
+    statsEnter("emit");
+    if (has_arrays || slots_used > BC_DEFAULT_MEM_SIZE) {
+        fprintf(bc_file, "MEMSIZE #%d\n", slots_used);
+    }
+    if (in_function) {
+        printf("Missing end of subroutine %s\n", function_name);
+        return 1;
+    }
     fprintf(bc_file, "END");
-    fclose(ir_file);
+    if (function_file) {
+        fprintf(bc_file, "\n");
+        copyFile(function_file, bc_file);
+        fclose(function_file);
+    }
+    if (binary) {
+        statsEnter("finalize");
+        FinalizeBC(bc_file, out_file);
+        fclose(out_file);
+    }
+    if (ir_file != stdin) fclose(ir_file);
     fclose(bc_file);
+    statsNote("slots", slots_used);
+    statsReport("bcgen", stats_json);
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,555 @@
+#ifndef PSEU_BYTECODE_H
+#define PSEU_BYTECODE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <signal.h>
+
+// Bytecode format shared by BCGen (writer), the VM and AOT (readers).
+//
+// Text form: one mnemonic per line, "PUSH #n" for literals, "PUSH [i]" or
+// "LOAD [i]" for memory, "PUSH $i" / "STORE $i" for locals of the current
+// frame, "; [i] name" comments naming slots, and an optional "MEMSIZE #n"
+// directive when arrays need more than the default memory. The main code
+// ends with END; each subroutine follows it as "FUNC name #args #returns",
+// then its body from ENTER to RET. "CALL name" refers to a FUNC by name.
+// A PARALLEL FOR body is a subroutine headed "KERNEL name #args #reductions"
+// instead; "PFOR name" runs it once per iteration and may only target a
+// KERNEL, which CALL may not.
+// 'CONST #h "text"' places a string constant in the pool under handle h.
+//
+// Binary form: a page-sized BytecodeHeader, then the Instr array starting on
+// the next page boundary so it can be mapped and executed in place, then the
+// string pool, the slot name table as (int32 slot, int32 length, bytes)
+// records, and the BcFunction table. CALL and PFOR operands are already
+// resolved to the callee's pc.
+
+typedef enum OpCode {
+    OP_PUSH,    // push immediate
+    OP_LOAD,    // push mem[arg]
+    OP_STORE,
+    OP_ADD,
+    OP_SUB,
+    OP_MUL,
+    OP_DIV,
+    OP_MULHI,
+    OP_SHL,
+    OP_SHR,
+    OP_SAR,
+    OP_OUT,
+    OP_END,
+    OP_LOADX,   // tos = mem[arg + tos]
+    OP_STOREX,  // mem[arg + tos] = next, pops both
+    OP_BOUND,   // fail unless 0 <= tos < arg
+    OP_CALL,    // jump to pc arg, arguments on the stack
+    OP_RET,     // return value, if any, stays on top of the stack
+    OP_ENTER,   // reserve arg zeroed locals for the new frame
+    OP_LOADL,   // push locals[arg]
+    OP_STOREL,
+    OP_CONCAT,  // string handles: next & tos
+    OP_OUTS,    // write the string tos
+    OP_SNAP,    // checkpoint: the VM may snapshot its state here
+    OP_PFOR,    // run KERNEL arg for first..last; pops first, last and its shared arguments
+    OP_RSUM,    // fold tos into reduction arg of the running PFOR, pops it
+    OP_RMIN,
+    OP_RMAX,
+    OP_MERGE,   // tos = tos folded with reduction arg of the last PFOR
+    OP_COUNT
+} OpCode;
+
+static const char* const opNames[OP_COUNT] = {
+    "PUSH", "LOAD", "STORE", "ADD", "SUB", "MUL", "DIV",
+    "MULHI", "SHL", "SHR", "SAR", "OUT", "END",
+    "LOADX", "STOREX", "BOUND", "CALL", "RET", "ENTER", "LOADL", "STOREL",
+    "CONCAT", "OUTS", "SNAP", "PFOR", "RSUM", "RMIN", "RMAX", "MERGE"
+};
+
+typedef struct Instr {
+    int32_t op;
+    int32_t arg;
+} Instr;
+
+#define BC_MAGIC "PSEUBC\x02"
+#define BC_MAGIC_LEN 8
+#define BC_PAGE_SIZE 4096
+#define BC_DEFAULT_MEM_SIZE 512     // slots a program gets without MEMSIZE
+
+typedef struct BcFunction {
+    int32_t pc;                 // its ENTER
+    int32_t nargs;
+    int32_t returns;            // 1 for a FUNCTION, 0 for a PROCEDURE and a KERNEL
+    int32_t reductions;         // accumulators of a KERNEL, -1 for FUNC
+} BcFunction;
+
+typedef struct BytecodeHeader {
+    char magic[BC_MAGIC_LEN];
+    uint32_t instr_offset;      // multiple of BC_PAGE_SIZE
+    uint32_t instr_count;       // includes the final OP_END
+    uint32_t names_offset;
+    uint32_t names_size;
+    uint32_t mem_size;          // 0 means the VM default
+    uint32_t funcs_offset;
+    uint32_t funcs_count;       // 0 in files without subroutines
+    uint32_t pool_offset;       // 4-byte aligned
+    uint32_t pool_size;
+} BytecodeHeader;
+
+// Strings
+//=======================
+// A string lives in a 32-bit slot as a handle. Low bit 0: up to three bytes
+// stored inline in the upper bytes, so a zeroed slot is the empty string.
+// Low bits 01 and 11: byte offset (h >> 2) of a record in the constant pool
+// or in the VM's arena. A record is an int32 length followed by the bytes,
+// padded to 4.
+// BC_AS_CODE expands a block below as C, BC_AS_TEXT turns it into its source
+// text, which AOT copies into the programs it generates. The blocks hold no
+// comments or directives, since those do not survive stringizing.
+#define BC_AS_CODE(...) __VA_ARGS__
+#define BC_AS_TEXT(...) #__VA_ARGS__ "\n"
+
+#define BC_STRING_FORMAT(AS) \
+AS(enum { BC_STR_INLINE_MAX = 3, BC_STR_POOL = 1, BC_STR_ARENA = 3 };) \
+AS(static inline int32_t bcInlineString(const char* text, int len) { \
+    uint32_t h = 0; \
+    for (int i = 0; i < len; i++) h |= (uint32_t)(unsigned char)text[i] << (8 * (i + 1)); \
+    return (int32_t)h; \
+}) \
+AS(static inline int bcInlineLength(int32_t h) { \
+    int len = 0; \
+    while (len < BC_STR_INLINE_MAX && (((uint32_t)h >> (8 * (len + 1))) & 0xff)) len++; \
+    return len; \
+}) \
+AS(static inline uint32_t bcRecordSize(int len) { \
+    return (4 + (uint32_t)len + 3) & ~3u; \
+}) \
+AS(static inline int32_t bcStringHandle(uint32_t offset, int kind) { \
+    return (int32_t)((offset << 2) | (uint32_t)kind); \
+})
+
+BC_STRING_FORMAT(BC_AS_CODE)
+
+// String operations of the VM, also run by AOT-compiled programs. The
+// includer defines str_pool, str_pool_size, arena, arena_used,
+// arena_capacity, inline_strings, arena_strings and growArena(needed),
+// which makes the arena at least needed bytes long. stringBytes decodes
+// inline strings into buf and returns pool and arena strings in place; the
+// sources of a concatenation are looked up again after growing, since that
+// may move the arena.
+#define BC_STRING_RUNTIME(AS) \
+AS(static const char* stringBytes(int32_t h, int* len, char* buf) { \
+    if ((h & 1) == 0) { \
+        *len = bcInlineLength(h); \
+        for (int i = 0; i < *len; i++) buf[i] = (char)((uint32_t)h >> (8 * (i + 1))); \
+        return buf; \
+    } \
+    const char* base = (h & 3) == BC_STR_POOL ? str_pool : arena; \
+    uint32_t size = (h & 3) == BC_STR_POOL ? str_pool_size : arena_used; \
+    uint32_t offset = (uint32_t)h >> 2; \
+    int32_t n; \
+    if (offset + 4 > size) { \
+        printf("Invalid string handle %d!\n", h); \
+        exit(1); \
+    } \
+    memcpy(&n, base + offset, 4); \
+    if (n < 0 || n > (int32_t)(size - offset - 4)) { \
+        printf("Invalid string handle %d!\n", h); \
+        exit(1); \
+    } \
+    *len = n; \
+    return base + offset + 4; \
+}) \
+AS(static int32_t concatStrings(int32_t a, int32_t b) { \
+    char abuf[BC_STR_INLINE_MAX], bbuf[BC_STR_INLINE_MAX]; \
+    int alen, blen; \
+    const char* abytes = stringBytes(a, &alen, abuf); \
+    const char* bbytes = stringBytes(b, &blen, bbuf); \
+    long long len = (long long)alen + blen; \
+    if (len <= BC_STR_INLINE_MAX) { \
+        char joined[BC_STR_INLINE_MAX]; \
+        memcpy(joined, abytes, alen); \
+        memcpy(joined + alen, bbytes, blen); \
+        inline_strings++; \
+        return bcInlineString(joined, (int)len); \
+    } \
+    uint32_t size = bcRecordSize((int)len); \
+    if (len > 0x3fffffff || (long long)arena_used + size > 0x3fffffff) { \
+        printf("String heap exhausted!\n"); \
+        exit(1); \
+    } \
+    if (arena_used + size > arena_capacity) growArena(arena_used + size); \
+    uint32_t offset = arena_used; \
+    int32_t n = (int32_t)len; \
+    memcpy(arena + offset, &n, 4); \
+    memcpy(arena + offset + 4, stringBytes(a, &alen, abuf), alen); \
+    memcpy(arena + offset + 4 + alen, stringBytes(b, &blen, bbuf), blen); \
+    arena_used += size; \
+    arena_strings++; \
+    return bcStringHandle(offset, BC_STR_ARENA); \
+})
+
+// Arithmetic
+//=======================
+// DIV of the VM and of AOT-compiled programs. A zero divisor and
+// INT32_MIN / -1 raise SIGFPE, as the x86 divide does, on every platform and
+// whatever the C compiler assumes about undefined division; output written
+// so far is flushed first.
+#define BC_DIVIDE(AS) \
+AS(static inline int32_t bcDivide(int32_t a, int32_t b) { \
+    if (b == 0 || (a == INT32_MIN && b == -1)) { \
+        fflush(stdout); \
+        raise(SIGFPE); \
+        exit(1); \
+    } \
+    return a / b; \
+})
+
+BC_DIVIDE(BC_AS_CODE)
+
+static char* bcTrim(char* str) {
+    while (*str == ' ' || *str == '\t') str++;
+    char* end = str + strlen(str) - 1;
+    while (end > str && (*end == ' ' || *end == '\t' || *end == '\n' || *end == '\r')) *end-- = '\0';
+    return str;
+}
+
+static int bcTakesArg(int op) {
+    return op == OP_LOADX || op == OP_STOREX || op == OP_BOUND || op == OP_ENTER
+        || op == OP_LOADL || op == OP_STOREL || op == OP_RSUM || op == OP_RMIN
+        || op == OP_RMAX || op == OP_MERGE;
+}
+
+// Decodes one text line. Returns 1 for an instruction, 2 for a MEMSIZE
+// directive (size in out->arg), 3 for a FUNC or KERNEL directive (filling
+// *fn except its pc), 4 for a CONST (handle in out->arg, text in *name), 0 for a blank
+// or comment line, -1 if the mnemonic is unknown.
+// A "; [i] name" comment sets *slot and *name (pointing into line);
+// otherwise *slot is -1. FUNC, KERNEL, CALL and PFOR set *name to the
+// subroutine name, and CALL and PFOR leave out->arg to be resolved by the
+// caller.
+static int bcDecodeLine(char* line, Instr* out, int* slot, char** name, BcFunction* fn) {
+    *slot = -1;
+    if (strncmp(line, "CONST #", 7) == 0) {
+        // the text may contain spaces, so take everything between the quotes
+        char* open = strchr(line, '"');
+        char* close = strrchr(line, '"');
+        if (!open || close == open) return -1;
+        *close = '\0';
+        out->op = OP_END;
+        out->arg = atoi(line + 7);
+        *name = open + 1;
+        return 4;
+    }
+    char* tok = strtok(line, " ");
+    if (!tok) return 0;
+    char* instr = bcTrim(tok);
+
+    if (instr[0] == ';') {
+        char* s = strtok(NULL, " ");
+        char* n = strtok(NULL, " ");
+        if (s && n && s[0] == '[') {
+            *slot = atoi(s + 1);
+            *name = bcTrim(n);
+        }
+        return 0;
+    }
+    if (instr[0] == '\0') return 0;
+
+    if (strcmp(instr, "PUSH") == 0 || strcmp(instr, "LOAD") == 0 || strcmp(instr, "STORE") == 0) {
+        char* tok_arg = strtok(NULL, " ");
+        if (!tok_arg) return -1;
+        char* arg = bcTrim(tok_arg);
+        out->arg = atoi(arg + 1);
+        if (instr[0] == 'S') out->op = (arg[0] == '$') ? OP_STOREL : OP_STORE;
+        else if (arg[0] == '$') out->op = OP_LOADL;
+        else out->op = (arg[0] == '#') ? OP_PUSH : OP_LOAD;
+        return 1;
+    }
+    for (int i = OP_ADD; i < OP_COUNT; i++) {
+        if (strcmp(instr, opNames[i]) == 0) {
+            out->op = i;
+            out->arg = 0;
+            if (bcTakesArg(i) || i == OP_CALL || i == OP_PFOR) {
+                char* tok_arg = strtok(NULL, " ");
+                if (!tok_arg) return -1;
+                if (i == OP_CALL || i == OP_PFOR) *name = bcTrim(tok_arg);
+                else out->arg = atoi(bcTrim(tok_arg) + 1);
+            }
+            return 1;
+        }
+    }
+    if (strcmp(instr, "FUNC") == 0 || strcmp(instr, "KERNEL") == 0) {
+        char* tok_name = strtok(NULL, " ");
+        char* tok_args = strtok(NULL, " ");
+        char* tok_third = strtok(NULL, " ");
+        if (!tok_name || !tok_args || !tok_third) return -1;
+        *name = bcTrim(tok_name);
+        fn->pc = -1;
+        fn->nargs = atoi(bcTrim(tok_args) + 1);
+        if (instr[0] == 'F') {
+            fn->returns = atoi(bcTrim(tok_third) + 1);
+            fn->reductions = -1;
+        } else {
+            fn->returns = 0;
+            fn->reductions = atoi(bcTrim(tok_third) + 1);
+        }
+        return 3;
+    }
+    if (strcmp(instr, "MEMSIZE") == 0) {
+        char* tok_arg = strtok(NULL, " ");
+        if (!tok_arg) return -1;
+        out->op = OP_END;
+        out->arg = atoi(bcTrim(tok_arg) + 1);
+        return 2;
+    }
+    return -1;
+}
+
+// Validation
+//=======================
+// Operands and stack depth are trusted by the VM's run() and by the C that
+// AOT generates, so both check a program with bcCheckProgram after loading.
+// The bytecode has no branches, so the depth at each pc is static: the main
+// code runs from 0 to its END and each subroutine, in table order right after
+// it, from its ENTER to its RET with its arguments on the stack. Errors exit.
+// The limits are the VM's; AOT compiles them in so programs fail alike.
+#define BC_STACK_SIZE 1024
+#define BC_CALL_DEPTH 4096
+#define BC_LOCALS_SIZE (64 * 1024)
+#define BC_MAX_REDUCTIONS 32
+
+typedef struct BcCheck {
+    const Instr* program;
+    int program_len;
+    const BcFunction* funcs;
+    int func_count;
+    int mem_size;
+    int* depth_at;                              // depth before each pc, filled if not NULL
+    OpCode (*reduce_ops)[BC_MAX_REDUCTIONS];    // op of each kernel accumulator, OP_COUNT while unused
+    int max_depth;                              // of the main code
+    int max_frame_depth;                        // of any subroutine
+} BcCheck;
+
+static inline const BcFunction* bcFunctionAt(const BcFunction* funcs, int func_count, int pc) {
+    for (int f = 0; f < func_count; f++) {
+        if (funcs[f].pc == pc) return &funcs[f];
+    }
+    return NULL;
+}
+
+static inline bool bcIsKernel(const BcFunction* fn) {
+    return fn && fn->reductions >= 0;
+}
+
+// Checks one region and returns the pc after it; fn is NULL for main.
+static inline int bcCheckRegion(BcCheck* c, int pc, const BcFunction* fn) {
+    const Instr* program = c->program;
+    int program_len = c->program_len;
+    int depth = fn ? fn->nargs : 0;
+    const BcFunction* last_loop = NULL;     // kernel whose results MERGE reads
+    int peak = depth;
+    int locals = 0;
+    if (fn) {
+        if (pc >= program_len || program[pc].op != OP_ENTER || program[pc].arg < 0 || program[pc].arg > BC_LOCALS_SIZE) {
+            printf("Error: Subroutine at %d does not start with a valid ENTER\n", pc);
+            exit(1);
+        }
+        locals = program[pc].arg;
+    }
+    for (; pc < program_len; pc++) {
+        Instr in = program[pc];
+        if (c->depth_at) c->depth_at[pc] = depth;
+        if (in.op < 0 || in.op >= OP_COUNT) {
+            printf("Unknown opcode %d at %d\n", in.op, pc);
+            exit(1);
+        }
+        if ((in.op == OP_LOAD || in.op == OP_STORE || in.op == OP_LOADX || in.op == OP_STOREX)
+            && (in.arg < 0 || in.arg >= c->mem_size)) {
+            printf("Memory index out of range: [%d]\n", in.arg);
+            exit(1);
+        }
+        if ((in.op == OP_LOADL || in.op == OP_STOREL) && (in.arg < 0 || in.arg >= locals)) {
+            printf("Local index out of range: $%d\n", in.arg);
+            exit(1);
+        }
+        if (in.op == OP_SNAP && fn) {
+            printf("Error: SNAP inside a subroutine at %d\n", pc);
+            exit(1);
+        }
+        if (in.op == OP_ENTER && (!fn || pc != fn->pc)) {
+            printf("Error: ENTER outside a subroutine prologue at %d\n", pc);
+            exit(1);
+        }
+        if (bcIsKernel(fn) && (in.op == OP_OUT || in.op == OP_OUTS || in.op == OP_CONCAT || in.op == OP_STORE)) {
+            printf("Error: %s inside a kernel at %d\n", opNames[in.op], pc);
+            exit(1);
+        }
+        if (in.op == OP_PFOR) {
+            const BcFunction* kernel = bcFunctionAt(c->funcs, c->func_count, in.arg);
+            if (fn || !bcIsKernel(kernel) || kernel->nargs < 1) {
+                printf("Error: PFOR at %d does not target a kernel from the main code\n", pc);
+                exit(1);
+            }
+            depth -= kernel->nargs + 1;
+            last_loop = kernel;
+        }
+        if (in.op == OP_RSUM || in.op == OP_RMIN || in.op == OP_RMAX) {
+            if (!bcIsKernel(fn) || in.arg < 0 || in.arg >= fn->reductions) {
+                printf("Error: Reduction index out of range: #%d at %d\n", in.arg, pc);
+                exit(1);
+            }
+            OpCode* op = &c->reduce_ops[fn - c->funcs][in.arg];
+            if (*op != OP_COUNT && *op != (OpCode)in.op) {
+                printf("Error: Reduction #%d is folded with two ops at %d\n", in.arg, pc);
+                exit(1);
+            }
+            *op = (OpCode)in.op;
+        }
+        if (in.op == OP_MERGE && (!last_loop || in.arg < 0 || in.arg >= last_loop->reductions)) {
+            printf("Error: MERGE at %d does not follow a PFOR with reduction #%d\n", pc, in.arg);
+            exit(1);
+        }
+        if (in.op == OP_SNAP) last_loop = NULL;    // a restored run has no loop results
+        if (in.op == OP_CALL) {
+            const BcFunction* callee = bcFunctionAt(c->funcs, c->func_count, in.arg);
+            if (!callee || bcIsKernel(callee)) {
+                printf("Error: CALL at %d does not target a subroutine\n", pc);
+                exit(1);
+            }
+            depth -= callee->nargs;
+            if (depth < 0) {
+                printf("Stack underflow!\n");
+                exit(1);
+            }
+            depth += callee->returns;
+        }
+        switch (in.op) {
+            case OP_PUSH: case OP_LOAD: case OP_LOADL: depth++; break;
+            case OP_END: case OP_LOADX: case OP_BOUND: case OP_CALL: case OP_RET: case OP_ENTER: case OP_SNAP:
+            case OP_PFOR: case OP_MERGE: break;
+            case OP_STOREX: depth -= 2; break;
+            default: depth--; break;    // STORE, OUT and binary operators
+        }
+        if (depth < 0) {
+            printf("Stack underflow!\n");
+            exit(1);
+        }
+        if (depth > BC_STACK_SIZE) {
+            printf("Stack overflow!\n");
+            exit(1);
+        }
+        if (depth > peak) peak = depth;
+        if (in.op == OP_END || in.op == OP_RET) break;
+    }
+    if (pc == program_len) {
+        printf("Error: Program does not end with %s\n", fn ? "RET" : "END");
+        exit(1);
+    }
+    if (program[pc].op != (fn ? OP_RET : OP_END)) {
+        printf("Error: %s at %d\n", fn ? "END inside a subroutine" : "RET outside a subroutine", pc);
+        exit(1);
+    }
+    if (fn && depth != fn->returns) {
+        printf("Error: Subroutine at %d returns %d values\n", fn->pc, depth);
+        exit(1);
+    }
+    if (fn) {
+        if (peak > c->max_frame_depth) c->max_frame_depth = peak;
+    } else {
+        c->max_depth = peak;
+    }
+    return pc + 1;
+}
+
+static inline int bcRegionEnd(const BcCheck* c, int f) {
+    return f + 1 < c->func_count ? c->funcs[f + 1].pc : c->program_len;
+}
+
+// True if subroutine f, or one it calls, loads from the array at base
+static inline bool bcReadsArray(const BcCheck* c, int f, int base, bool* seen) {
+    if (seen[f]) return false;
+    seen[f] = true;
+    for (int pc = c->funcs[f].pc; pc < bcRegionEnd(c, f); pc++) {
+        Instr in = c->program[pc];
+        if (in.op == OP_LOADX && in.arg == base) return true;
+        if (in.op == OP_CALL && bcReadsArray(c, (int)(bcFunctionAt(c->funcs, c->func_count, in.arg) - c->funcs), base, seen)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Iterations run concurrently, so a kernel may only call subroutines that
+// write nothing but their own frame, found by iterating to a fixpoint, and
+// that read no array the kernel writes, since they may read any element.
+static inline void bcCheckKernelCalls(const BcCheck* c) {
+    const Instr* program = c->program;
+    bool* impure = malloc(sizeof(bool) * (c->func_count + 1));
+    bool* seen = malloc(sizeof(bool) * (c->func_count + 1));
+    memset(impure, 0, sizeof(bool) * (c->func_count + 1));
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (int f = 0; f < c->func_count; f++) {
+            for (int pc = c->funcs[f].pc; pc < bcRegionEnd(c, f) && !impure[f] && !bcIsKernel(&c->funcs[f]); pc++) {
+                OpCode op = (OpCode)program[pc].op;
+                if (op == OP_OUT || op == OP_OUTS || op == OP_CONCAT || op == OP_STORE || op == OP_STOREX
+                    || (op == OP_CALL && impure[bcFunctionAt(c->funcs, c->func_count, program[pc].arg) - c->funcs])) {
+                    impure[f] = changed = true;
+                }
+            }
+        }
+    }
+    for (int f = 0; f < c->func_count; f++) {
+        if (!bcIsKernel(&c->funcs[f])) continue;
+        int end = bcRegionEnd(c, f);
+        for (int pc = c->funcs[f].pc; pc < end; pc++) {
+            if (program[pc].op != OP_CALL) continue;
+            int callee = (int)(bcFunctionAt(c->funcs, c->func_count, program[pc].arg) - c->funcs);
+            if (impure[callee]) {
+                printf("Error: Kernel calls a subroutine with side effects at %d\n", pc);
+                exit(1);
+            }
+            for (int w = c->funcs[f].pc; w < end; w++) {
+                if (program[w].op != OP_STOREX) continue;
+                memset(seen, 0, sizeof(bool) * (c->func_count + 1));
+                if (bcReadsArray(c, callee, program[w].arg, seen)) {
+                    printf("Error: Kernel calls a subroutine that reads the array [%d] it writes at %d\n",
+                           program[w].arg, pc);
+                    exit(1);
+                }
+            }
+        }
+    }
+    free(seen);
+    free(impure);
+}
+
+// Fills c->reduce_ops (to be freed by the caller), the depths and depth_at
+static inline void bcCheckProgram(BcCheck* c) {
+    c->reduce_ops = malloc(sizeof(*c->reduce_ops) * (c->func_count + 1));
+    for (int f = 0; f < c->func_count; f++) {
+        for (int k = 0; k < BC_MAX_REDUCTIONS; k++) c->reduce_ops[f][k] = OP_COUNT;
+    }
+    c->max_depth = c->max_frame_depth = 0;
+    int pc = bcCheckRegion(c, 0, NULL);
+    for (int f = 0; f < c->func_count; f++) {
+        const BcFunction* fn = &c->funcs[f];
+        if (fn->pc != pc || fn->nargs < 0 || fn->returns < 0 || fn->returns > 1
+            || fn->reductions < -1 || fn->reductions > BC_MAX_REDUCTIONS
+            || (bcIsKernel(fn) && fn->returns != 0)) {
+            printf("Error: Subroutine table does not match the code\n");
+            exit(1);
+        }
+        pc = bcCheckRegion(c, pc, fn);
+    }
+    if (pc != c->program_len) {
+        printf("Error: Code after the last subroutine\n");
+        exit(1);
+    }
+    bcCheckKernelCalls(c);
+}
+
+#endif
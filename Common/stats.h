@@ -0,0 +1,295 @@
+#ifndef PSEU_STATS_H
+#define PSEU_STATS_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <errno.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// --stats support shared by IRGen, BCGen and the VM.
+//
+// A tool switches between named phases with statsEnter; the time and
+// counter deltas since the last switch are charged to the phase being left,
+// so a phase entered once per statement accumulates over the whole run.
+// Counters are user-space instructions, cycles, cache misses and branch
+// mispredicts from perf_event_open, read as one group. They are inherited,
+// so threads started after statsInit (the VM's PFOR workers) are summed
+// into the totals; kernels that refuse inherited groups (before 4.3) get
+// counters for the calling thread only. When
+// they cannot be opened (not Linux, no PMU, perf_event_paranoid) only wall
+// time is kept. Nothing is measured unless statsInit was called; then each
+// switch costs one read of the counter group.
+//
+// Include this header after every other one: it routes malloc, calloc,
+// realloc, free and strdup through counting wrappers.
+
+#define STATS_MAX_PHASES 8
+#define STATS_COUNTERS 4
+#define STATS_MAX_NOTES 8
+
+static const char* const statsCounterNames[STATS_COUNTERS] = {
+    "instructions", "cycles", "cache_misses", "branch_misses"
+};
+
+typedef struct StatsPhase {
+    const char* name;
+    long long calls;
+    double wall;
+    uint64_t counters[STATS_COUNTERS];
+} StatsPhase;
+
+static bool stats_on = false;
+static int stats_counter_fd = -1;       // group leader, -1 without counters
+static int stats_counter_count = 0;
+static char stats_counter_error[128] = "";
+static StatsPhase stats_phases[STATS_MAX_PHASES];
+static int stats_phase_count = 0;
+static int stats_current = -1;
+static double stats_mark_wall = 0;
+static uint64_t stats_mark[STATS_COUNTERS];
+
+static const char* stats_note_names[STATS_MAX_NOTES];
+static long long stats_note_values[STATS_MAX_NOTES];
+static int stats_note_count = 0;
+
+static long long stats_allocs = 0;
+static long long stats_alloc_bytes = 0;
+static long long stats_frees = 0;
+
+static double statsWall(void) {
+#ifdef _WIN32
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+#ifdef __linux__
+static int statsOpenCounter(uint64_t config, int group) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = config;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP;
+    attr.inherit = 1;
+    int fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, group, 0);
+    if (fd < 0 && errno == EINVAL) {
+        attr.inherit = 0;
+        fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, group, 0);
+    }
+    return fd;
+}
+#endif
+
+// Reads the running totals; counters that did not open stay 0
+static void statsReadCounters(uint64_t* out) {
+    memset(out, 0, sizeof(uint64_t) * STATS_COUNTERS);
+#ifdef __linux__
+    if (stats_counter_fd < 0) return;
+    uint64_t buf[1 + STATS_COUNTERS];
+    if (read(stats_counter_fd, buf, sizeof(buf)) < (ssize_t)sizeof(uint64_t)) return;
+    for (uint64_t i = 0; i < buf[0] && i < STATS_COUNTERS; i++) out[i] = buf[1 + i];
+#endif
+}
+
+static void statsInit(void) {
+    stats_on = true;
+#ifdef __linux__
+    static const uint64_t configs[STATS_COUNTERS] = {
+        PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CPU_CYCLES,
+        PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES
+    };
+    stats_counter_fd = statsOpenCounter(configs[0], -1);
+    if (stats_counter_fd < 0) {
+        snprintf(stats_counter_error, sizeof(stats_counter_error), "perf_event_open: %s", strerror(errno));
+    } else {
+        // a member the PMU lacks ends the group; later names would be misread
+        stats_counter_count = 1;
+        while (stats_counter_count < STATS_COUNTERS
+               && statsOpenCounter(configs[stats_counter_count], stats_counter_fd) >= 0) {
+            stats_counter_count++;
+        }
+    }
+#else
+    snprintf(stats_counter_error, sizeof(stats_counter_error), "hardware counters need Linux");
+#endif
+    stats_mark_wall = statsWall();
+    statsReadCounters(stats_mark);
+}
+
+// Charges the time since the last switch to the current phase and makes
+// name current; NULL stops charging.
+static void statsEnter(const char* name) {
+    if (!stats_on) return;
+    double now = statsWall();
+    uint64_t counters[STATS_COUNTERS];
+    statsReadCounters(counters);
+    if (stats_current >= 0) {
+        StatsPhase* phase = &stats_phases[stats_current];
+        phase->wall += now - stats_mark_wall;
+        for (int i = 0; i < STATS_COUNTERS; i++) phase->counters[i] += counters[i] - stats_mark[i];
+    }
+    stats_current = -1;
+    if (name) {
+        int p = 0;
+        while (p < stats_phase_count && stats_phases[p].name != name && strcmp(stats_phases[p].name, name)) p++;
+        if (p == stats_phase_count && p < STATS_MAX_PHASES) {
+            memset(&stats_phases[p], 0, sizeof(StatsPhase));
+            stats_phases[p].name = name;
+            stats_phase_count++;
+        }
+        if (p < STATS_MAX_PHASES) {
+            stats_phases[p].calls++;
+            stats_current = p;
+        }
+    }
+    // the switch itself is charged to neither phase
+    stats_mark_wall = statsWall();
+    memcpy(stats_mark, counters, sizeof(counters));
+}
+
+// Extra tool-specific figure for the report
+static void statsNote(const char* name, long long value) {
+    if (stats_note_count < STATS_MAX_NOTES) {
+        stats_note_names[stats_note_count] = name;
+        stats_note_values[stats_note_count++] = value;
+    }
+}
+
+static long long statsPeakRssKb(void) {
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS pmc;
+    if (!K32GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc))) return 0;
+    return (long long)(pmc.PeakWorkingSetSize / 1024);
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+    return usage.ru_maxrss;
+#endif
+}
+
+// Ends the current phase and writes the report to stderr, as a table or as
+// one JSON object
+static void statsReport(const char* tool, bool json) {
+    if (!stats_on) return;
+    statsEnter(NULL);
+    long long rss = statsPeakRssKb();
+    if (json) {
+        fprintf(stderr, "{\"tool\": \"%s\", \"counters\": %s, \"phases\": [", tool, stats_counter_count ? "true" : "false");
+        for (int p = 0; p < stats_phase_count; p++) {
+            StatsPhase* phase = &stats_phases[p];
+            fprintf(stderr, "%s{\"name\": \"%s\", \"calls\": %lld, \"wall_ms\": %.3f", p ? ", " : "",
+                    phase->name, phase->calls, phase->wall * 1e3);
+            for (int i = 0; i < STATS_COUNTERS; i++) {
+                if (i < stats_counter_count) {
+                    fprintf(stderr, ", \"%s\": %llu", statsCounterNames[i], (unsigned long long)phase->counters[i]);
+                } else {
+                    fprintf(stderr, ", \"%s\": null", statsCounterNames[i]);
+                }
+            }
+            fprintf(stderr, "}");
+        }
+        fprintf(stderr, "], \"peak_rss_kb\": %lld, \"allocations\": %lld, \"allocated_bytes\": %lld, \"frees\": %lld",
+                rss, stats_allocs, stats_alloc_bytes, stats_frees);
+        for (int n = 0; n < stats_note_count; n++) {
+            fprintf(stderr, ", \"%s\": %lld", stats_note_names[n], stats_note_values[n]);
+        }
+        fprintf(stderr, "}\n");
+        return;
+    }
+    fprintf(stderr, "[stats] %s\n", tool);
+    fprintf(stderr, "  %-10s %10s %10s", "phase", "calls", "wall ms");
+    for (int i = 0; i < stats_counter_count; i++) fprintf(stderr, " %14s", statsCounterNames[i]);
+    fprintf(stderr, "\n");
+    for (int p = 0; p < stats_phase_count; p++) {
+        StatsPhase* phase = &stats_phases[p];
+        fprintf(stderr, "  %-10s %10lld %10.3f", phase->name, phase->calls, phase->wall * 1e3);
+        for (int i = 0; i < stats_counter_count; i++) {
+            fprintf(stderr, " %14llu", (unsigned long long)phase->counters[i]);
+        }
+        fprintf(stderr, "\n");
+    }
+    if (!stats_counter_count) fprintf(stderr, "  counters unavailable (%s), wall time only\n", stats_counter_error);
+    fprintf(stderr, "  peak rss %lld KB, %lld allocations (%lld bytes), %lld frees\n",
+            rss, stats_allocs, stats_alloc_bytes, stats_frees);
+    for (int n = 0; n < stats_note_count; n++) {
+        fprintf(stderr, "  %s %lld\n", stats_note_names[n], stats_note_values[n]);
+    }
+}
+
+// Parses "--stats" or "--stats=json"; returns false for other arguments
+static bool statsFlag(const char* arg, bool* json) {
+    if (!strcmp(arg, "--stats")) {
+        *json = false;
+    } else if (!strcmp(arg, "--stats=json")) {
+        *json = true;
+    } else {
+        return false;
+    }
+    statsInit();
+    return true;
+}
+
+// Allocation counting
+static void* statsMalloc(size_t size) {
+    stats_allocs++;
+    stats_alloc_bytes += size;
+    return malloc(size);
+}
+
+static inline void* statsCalloc(size_t count, size_t size) {
+    stats_allocs++;
+    stats_alloc_bytes += count * size;
+    return calloc(count, size);
+}
+
+static void* statsRealloc(void* p, size_t size) {
+    stats_allocs++;
+    stats_alloc_bytes += size;
+    return realloc(p, size);
+}
+
+static char* statsStrdup(const char* s) {
+    size_t size = strlen(s) + 1;
+    stats_allocs++;
+    stats_alloc_bytes += size;
+    char* copy = malloc(size);
+    if (copy) memcpy(copy, s, size);
+    return copy;
+}
+
+static void statsFree(void* p) {
+    if (p) stats_frees++;
+    free(p);
+}
+
+#define malloc(size) statsMalloc(size)
+#define calloc(count, size) statsCalloc(count, size)
+#define realloc(p, size) statsRealloc(p, size)
+#define free(p) statsFree(p)
+#undef _strdup
+#define _strdup(s) statsStrdup(s)
+#define strdup(s) statsStrdup(s)
+
+#endif
@@ -6,6 +6,8 @@
 #include <stdlib.h>
 #include <stdbool.h>
 
+#include "../Common/stats.h"
+
 #define OPSIZE 32
 
 // Lexer
@@ -25,7 +27,28 @@ typedef enum {
     TOK_END,
     TOK_EOF,
     TOK_OUTPUT,
-    TOK_PAREN
+    TOK_LPAREN,
+    TOK_RPAREN,
+    TOK_ARRAY,
+    TOK_OF,
+    TOK_LBRACKET,
+    TOK_RBRACKET,
+    TOK_COMMA,
+    TOK_FUNCTION,
+    TOK_ENDFUNCTION,
+    TOK_PROCEDURE,
+    TOK_ENDPROCEDURE,
+    TOK_RETURNS,
+    TOK_RETURN,
+    TOK_CALL,
+    TOK_TYPE_STRING,
+    TOK_STRING,         // "literal", lexeme without the quotes
+    TOK_AMP,
+    TOK_CHECKPOINT,
+    TOK_PARALLEL,
+    TOK_FOR,
+    TOK_TO,
+    TOK_NEXT
 } TokenType;
 
 typedef struct {
@@ -102,29 +125,61 @@ bool isReal(char* str) {
 }
 
 bool isSpecialSym(char* str, TokenType* type) {
-    const char* specialSyms[] = {":", "<-", "(", ")"};
-    if (!check(str, specialSyms, 4)) {return false;}
+    const char* specialSyms[] = {":", "<-", "(", ")", "[", "]", ","};
+    if (!check(str, specialSyms, 7)) {return false;}
     if (!strcmp(str, ":")) {*type = TOK_COLON;}
+    else if (!strcmp(str, ",")) {*type = TOK_COMMA;}
+    else if (!strcmp(str, "[")) {*type = TOK_LBRACKET;}
+    else if (!strcmp(str, "]")) {*type = TOK_RBRACKET;}
     else if (!strcmp(str, "<-")) {*type = TOK_ASSIGN;}
-    else if (!strcmp(str, "(") || !strcmp(str, ")")) {*type = TOK_PAREN;}
+    else if (!strcmp(str, "(")) {*type = TOK_LPAREN;}
+    else if (!strcmp(str, ")")) {*type = TOK_RPAREN;}
     return true;
 }
 
 bool isKeyword(char* str, TokenType* type) {
-    const char* keywords[] = {"DECLARE", "INTEGER", "REAL", "STRING", "OUTPUT"};
-    if (!check(str, keywords, 5)) {return false;}
+    const char* keywords[] = {"DECLARE", "INTEGER", "REAL", "STRING", "OUTPUT", "ARRAY", "OF",
+                              "FUNCTION", "ENDFUNCTION", "PROCEDURE", "ENDPROCEDURE", "RETURNS", "RETURN", "CALL",
+                              "CHECKPOINT", "PARALLEL", "FOR", "TO", "NEXT"};
+    if (!check(str, keywords, 19)) {return false;}
+    if (!strcmp(str, "CHECKPOINT")) {*type = TOK_CHECKPOINT;}
+    if (!strcmp(str, "PARALLEL")) {*type = TOK_PARALLEL;}
+    if (!strcmp(str, "FOR")) {*type = TOK_FOR;}
+    if (!strcmp(str, "TO")) {*type = TOK_TO;}
+    if (!strcmp(str, "NEXT")) {*type = TOK_NEXT;}
+    if (!strcmp(str, "FUNCTION")) {*type = TOK_FUNCTION;}
+    if (!strcmp(str, "ENDFUNCTION")) {*type = TOK_ENDFUNCTION;}
+    if (!strcmp(str, "PROCEDURE")) {*type = TOK_PROCEDURE;}
+    if (!strcmp(str, "ENDPROCEDURE")) {*type = TOK_ENDPROCEDURE;}
+    if (!strcmp(str, "RETURNS")) {*type = TOK_RETURNS;}
+    if (!strcmp(str, "RETURN")) {*type = TOK_RETURN;}
+    if (!strcmp(str, "CALL")) {*type = TOK_CALL;}
+    if (!strcmp(str, "ARRAY")) {*type = TOK_ARRAY;}
+    if (!strcmp(str, "OF")) {*type = TOK_OF;}
     if (!strcmp(str, "DECLARE")) {*type = TOK_DECLARE;}
     if (!strcmp(str, "INTEGER")) {*type = TOK_TYPE_INT;}
     if (!strcmp(str, "REAL")) {*type = TOK_REAL;}
+    if (!strcmp(str, "STRING")) {*type = TOK_TYPE_STRING;}
     if (!strcmp(str, "OUTPUT")) {
         *type = TOK_OUTPUT;
     }
     return true;
 }
 
+// Keywords of IR statements, including the "array" declaration and the
+// "unchecked" index marker; an identifier spelled like one would be read
+// back by BCGen as that keyword
+bool isReserved(char* str) {
+    const char* reserved[] = {"call", "return", "function", "procedure", "endfunction", "endprocedure",
+                              "outputs", "checkpoint", "kernel", "endkernel", "pfor", "reduce", "merge",
+                              "unchecked", "array"};
+    return check(str, reserved, 15);
+}
+
 bool isOper(char* str, TokenType* type) {
-    const char* opers[] = {"+", "-", "*", "/"};
-    if (!check(str, opers, 4)) {return false;}
+    const char* opers[] = {"+", "-", "*", "/", "&"};
+    if (!check(str, opers, 5)) {return false;}
+    if (!strcmp(str, "&")) {*type = TOK_AMP;}
     if (!strcmp(str, "+")) {*type = TOK_PLUS;}
     else if (!strcmp(str, "-")) {*type = TOK_MINUS;}
     else if (!strcmp(str, "*")) {*type = TOK_STAR;}
@@ -143,22 +198,45 @@ typedef enum {
     NODE_OUTPUT,
     NODE_BINARY_OP,
     NODE_IDENTIFIER,
-    NODE_LITERAL
+    NODE_LITERAL,
+    NODE_ARRAY_DECL,
+    NODE_INDEX,
+    NODE_FUNCTION,      // name; children: NODE_PARAMS, then the body
+    NODE_PROCEDURE,
+    NODE_PARAMS,
+    NODE_RETURN,
+    NODE_CALL,          // name; children: arguments. Used as a value
+    NODE_CALL_STMT,     // CALL statement
+    NODE_END_FUNCTION,
+    NODE_END_PROCEDURE,
+    NODE_CHECKPOINT,
+    NODE_PARALLEL_FOR,  // loop variable; children: first, last, NODE_REDUCTIONS, then the body
+    NODE_REDUCTIONS,
+    NODE_REDUCTION,     // kind in value; children: the variable
+    NODE_NEXT           // loop variable
 } NodeType;
 
 typedef enum {
     INT,
     REAL,
-    CHAR
+    CHAR,
+    STR
 } VarType;
 
 typedef enum {
     ADD,
     MUL,
     SUB,
-    DIV
+    DIV,
+    CAT
 } OpType;
 
+typedef enum {
+    RED_SUM,
+    RED_MIN,
+    RED_MAX
+} ReduceKind;
+
 // AST Node
 typedef struct ASTNode{
     NodeType type;
@@ -195,6 +273,12 @@ ASTNode *create_identifier(char *name) {
     return node;
 }
 
+ASTNode *create_literal(char *text) {
+    ASTNode *node = new_node(NODE_LITERAL);
+    node->data.name = _strdup(text);
+    return node;
+}
+
 ASTNode *create_number(int value) {
     ASTNode *node = new_node(NODE_NUMBER);
     node->data.value = value;
@@ -213,6 +297,45 @@ ASTNode *create_var_decl(VarType vtype, char *name) {
     return node;
 }
 
+// children: identifier, lower bound, upper bound
+ASTNode *create_array_decl(VarType vtype, char *name, int lower, int upper) {
+    ASTNode *node = new_node(NODE_ARRAY_DECL);
+    node->data.var_type = vtype;
+
+    node->children = malloc(sizeof(ASTNode*) * 3);
+    node->children[0] = create_identifier(name);
+    node->children[1] = create_number(lower);
+    node->children[2] = create_number(upper);
+    node->child_count = 3;
+
+    return node;
+}
+
+ASTNode *create_index(ASTNode *array, ASTNode *index) {
+    ASTNode *node = new_node(NODE_INDEX);
+
+    node->children = malloc(sizeof(ASTNode*) * 2);
+    node->children[0] = array;
+    node->children[1] = index;
+    node->child_count = 2;
+
+    return node;
+}
+
+// children[0] holds the parameters, body statements are appended later
+ASTNode *create_subroutine(NodeType type, char *name) {
+    ASTNode *node = new_node(type);
+    node->data.name = _strdup(name);
+    add_child(node, new_node(NODE_PARAMS));
+    return node;
+}
+
+ASTNode *create_call(NodeType type, char *name) {
+    ASTNode *node = new_node(type);
+    node->data.name = _strdup(name);
+    return node;
+}
+
 ASTNode *create_bin_op(OpType op, ASTNode *left, ASTNode *right) {
     ASTNode *node = new_node(NODE_BINARY_OP);
     node->data.op = op;
@@ -244,12 +367,63 @@ ASTNode *create_output(ASTNode *expr) {
     return node;
 }
 
+void free_ast(ASTNode* node) {
+    if (!node) return;
+    for (int i = 0; i < node->child_count; i++) {
+        free_ast(node->children[i]);
+    }
+    if (node->type == NODE_IDENTIFIER || node->type == NODE_LITERAL || node->type == NODE_FUNCTION
+        || node->type == NODE_PROCEDURE || node->type == NODE_CALL || node->type == NODE_CALL_STMT
+        || node->type == NODE_PARALLEL_FOR || node->type == NODE_NEXT) {
+        free(node->data.name);
+    }
+    free(node->children);
+    free(node);
+}
+
 // Tokenizer
-int tokenize(char* str, Token* tokens, int max_tokens) {
+// Brackets, parentheses, ':' and ',' may be written without spaces around
+// them, except inside string literals
+char* space_symbols(const char* str) {
+    int len = strlen(str);
+    char* spaced = malloc(len * 3 + 1);
+    int j = 0;
+    bool quoted = false;
+    for (int i = 0; i < len; i++) {
+        if (str[i] == '"') { quoted = !quoted; }
+        if (!quoted && strchr("[]():,", str[i])) {
+            spaced[j++] = ' ';
+            spaced[j++] = str[i];
+            spaced[j++] = ' ';
+        } else {
+            spaced[j++] = str[i];
+        }
+    }
+    spaced[j] = '\0';
+    return spaced;
+}
+
+int tokenize_words(char* str, Token* tokens, int max_tokens) {
     TokenType type;
     int left = 0, right = 0, i = 0, len = strlen(str);
     while (right <= len && left <= len) {
-        if (!isDelimiter(str[right])) { right++; }
+        if (str[right] == '"' && left == right) {
+            // a string literal is one token, spaces included
+            char* close = strchr(str + right + 1, '"');
+            if (!close) {
+                printf("Unterminated string literal!\n");
+                exit(1);
+            }
+            if (i >= max_tokens-1) {
+                printf("OverflowError!\n");
+                exit(1);
+            }
+            tokens[i].type = TOK_STRING;
+            tokens[i].lexeme = slice(str, right + 1, (int)(close - str) - 1);
+            i++;
+            left = right = (int)(close - str) + 1;
+        }
+        else if (!isDelimiter(str[right])) { right++; }
         else if (isDelimiter(str[right]) && left == right) { left = ++right; }
         else if (isDelimiter(str[right]) && left != right) {
             if (i >= max_tokens-1) {
@@ -273,6 +447,11 @@ int tokenize(char* str, Token* tokens, int max_tokens) {
                 tokens[i].type = type;
                 tokens[i].lexeme = _strdup(substr);
             } else if (isIdentifier(substr)) {
+                if (isReserved(substr)) {
+                    printf("%s is a reserved word!\n", substr);
+                    free(substr);
+                    exit(1);
+                }
                 tokens[i].type = TOK_IDENTIFIER;
                 tokens[i].lexeme = _strdup(substr);
             } else if (isReal(substr)) {
@@ -298,6 +477,13 @@ int tokenize(char* str, Token* tokens, int max_tokens) {
     return i+1;
 }
 
+int tokenize(char* str, Token* tokens, int max_tokens) {
+    char* spaced = space_symbols(str);
+    int count = tokenize_words(spaced, tokens, max_tokens);
+    free(spaced);
+    return count;
+}
+
 // AST Parser
 Token tokens[100];
 int current_token = 0;
@@ -326,6 +512,7 @@ VarType mapType(TokenType tok) {
     switch (tok) {
         case TOK_TYPE_INT: return INT;
         case TOK_TYPE_REAL:    return REAL;
+        case TOK_TYPE_STRING:  return STR;
         default:
             printf("Unknown type token: %d\n", tok);
             exit(1);
@@ -344,14 +531,114 @@ ASTNode* parse_decl(void) {
         exit(1);
     }
     nextToken();
-    if (!matchTokens(TOK_TYPE_INT) && !matchTokens(TOK_TYPE_REAL)) {
+    if (matchTokens(TOK_ARRAY)) {
+        nextToken();
+        checkToken(TOK_LBRACKET);
+        if (!matchTokens(TOK_INT)) {
+            printf("Expected Integer lower bound!\n");
+            exit(1);
+        }
+        int lower = peekToken(0)->value;
+        nextToken();
+        checkToken(TOK_COLON);
+        if (!matchTokens(TOK_INT)) {
+            printf("Expected Integer upper bound!\n");
+            exit(1);
+        }
+        int upper = peekToken(0)->value;
+        nextToken();
+        checkToken(TOK_RBRACKET);
+        checkToken(TOK_OF);
+        if (!matchTokens(TOK_TYPE_INT)) {
+            printf("Only ARRAY OF INTEGER is supported!\n");
+            exit(1);
+        }
+        if (upper < lower) {
+            printf("Array %s has upper bound below lower bound!\n", name);
+            exit(1);
+        }
+        nextToken();
+        checkToken(TOK_END);
+        ASTNode* decl = create_array_decl(INT, name, lower, upper);
+        free(name);
+        return decl;
+    }
+    if (!matchTokens(TOK_TYPE_INT) && !matchTokens(TOK_TYPE_REAL) && !matchTokens(TOK_TYPE_STRING)) {
         printf("Expected Valid Type after Identifier!\n");
         exit(1);
     }
     VarType vtype = mapType(peekToken(0)->type);
     nextToken();
     checkToken(TOK_END);
-    return create_var_decl(vtype, name);
+    ASTNode* decl = create_var_decl(vtype, name);
+    free(name);
+    return decl;
+}
+
+ASTNode* parse_operand(void);
+
+// ( arg, arg, ... ) after a subroutine name; each argument is an operand.
+void parse_arguments(ASTNode* call) {
+    checkToken(TOK_LPAREN);
+    if (matchTokens(TOK_RPAREN)) {
+        nextToken();
+        return;
+    }
+    while (true) {
+        add_child(call, parse_operand());
+        if (matchTokens(TOK_RPAREN)) {
+            nextToken();
+            return;
+        }
+        if (!matchTokens(TOK_COMMA)) {
+            printf("Expected \",\" or \")\" in argument list!\n");
+            exit(1);
+        }
+        nextToken();
+    }
+}
+
+// A number, a string, a variable, an array element or a function call;
+// consumes its tokens.
+ASTNode* parse_operand(void) {
+    if (matchTokens(TOK_INT) || matchTokens(TOK_REAL)) {
+        ASTNode* number = create_number(peekToken(0)->value);
+        nextToken();
+        return number;
+    }
+    if (matchTokens(TOK_STRING)) {
+        ASTNode* literal = create_literal(peekToken(0)->lexeme);
+        nextToken();
+        return literal;
+    }
+    if (!matchTokens(TOK_IDENTIFIER)) {
+        printf("Expected Number or Identifier!\n");
+        exit(1);
+    }
+    if (peekToken(1)->type == TOK_LPAREN) {
+        ASTNode* call = create_call(NODE_CALL, peekToken(0)->lexeme);
+        nextToken();
+        parse_arguments(call);
+        return call;
+    }
+    ASTNode* id = create_identifier(peekToken(0)->lexeme);
+    nextToken();
+    if (!matchTokens(TOK_LBRACKET)) {
+        return id;
+    }
+    nextToken();
+    ASTNode* index;
+    if (matchTokens(TOK_INT)) {
+        index = create_number(peekToken(0)->value);
+    } else if (matchTokens(TOK_IDENTIFIER)) {
+        index = create_identifier(peekToken(0)->lexeme);
+    } else {
+        printf("Expected Number or Identifier as array index!\n");
+        exit(1);
+    }
+    nextToken();
+    checkToken(TOK_RBRACKET);
+    return create_index(id, index);
 }
 
 ASTNode* parse_exp(void) {
@@ -359,14 +646,12 @@ ASTNode* parse_exp(void) {
     int top = -1;
 
     while (!matchTokens(TOK_END)) {
-        if (matchTokens(TOK_INT) || matchTokens(TOK_REAL)) {
-            stack[++top] = create_number(peekToken(0)->value);
-        } 
-        else if (matchTokens(TOK_IDENTIFIER)) {
-            stack[++top] = create_identifier(peekToken(0)->lexeme);
+        if (matchTokens(TOK_INT) || matchTokens(TOK_REAL) || matchTokens(TOK_IDENTIFIER) || matchTokens(TOK_STRING)) {
+            stack[++top] = parse_operand();
+            continue;
         } 
         else if (matchTokens(TOK_PLUS) || matchTokens(TOK_MINUS) ||
-                 matchTokens(TOK_STAR) || matchTokens(TOK_SLASH)) {
+                 matchTokens(TOK_STAR) || matchTokens(TOK_SLASH) || matchTokens(TOK_AMP)) {
 
                 if (top < 1) {
                     printf("Invalid RPN expression!\n");
@@ -381,6 +666,7 @@ ASTNode* parse_exp(void) {
                     case TOK_MINUS: op = SUB; break;
                     case TOK_STAR:  op = MUL; break;
                     case TOK_SLASH: op = DIV; break;
+                    case TOK_AMP:   op = CAT; break;
                     default: printf("Unknown operator!\n"); exit(1);
                 }
                 stack[++top] = create_bin_op(op, left, right);
@@ -400,10 +686,7 @@ ASTNode* parse_exp(void) {
 }
 
 ASTNode* parse_assign(void) {
-    char* name = _strdup(peekToken(0)->lexeme);
-    ASTNode* id = create_identifier(name);
-    free(name);
-    nextToken();
+    ASTNode* id = parse_operand();
     if (!matchTokens(TOK_ASSIGN)) {
         printf("Expected \"<-\" after Identifier!\n");
         exit(1);
@@ -416,19 +699,109 @@ ASTNode* parse_assign(void) {
 
 ASTNode* parse_output(void) {
     ASTNode* result;
-    if (matchTokens(TOK_INT) || matchTokens(TOK_REAL)) {
-        result = create_output(create_number(peekToken(0)->value));
-    } else if (matchTokens(TOK_IDENTIFIER)) {
-        result = create_output(create_identifier(peekToken(0)->lexeme));
+    if (matchTokens(TOK_INT) || matchTokens(TOK_REAL) || matchTokens(TOK_IDENTIFIER) || matchTokens(TOK_STRING)) {
+        result = create_output(parse_operand());
     } else {
         printf("Invalid Ouput Error!\n");
         exit(1);
     }
-    nextToken();
     checkToken(TOK_END);
     return result;
 }
 
+// FUNCTION name(a : INTEGER, ...) RETURNS INTEGER
+// PROCEDURE name(a : INTEGER, ...)
+ASTNode* parse_subroutine(NodeType type) {
+    if (!matchTokens(TOK_IDENTIFIER)) {
+        printf("Expected Identifier after %s!\n", type == NODE_FUNCTION ? "FUNCTION" : "PROCEDURE");
+        exit(1);
+    }
+    ASTNode* node = create_subroutine(type, peekToken(0)->lexeme);
+    ASTNode* params = node->children[0];
+    nextToken();
+    checkToken(TOK_LPAREN);
+    while (!matchTokens(TOK_RPAREN)) {
+        if (params->child_count > 0) { checkToken(TOK_COMMA); }
+        if (!matchTokens(TOK_IDENTIFIER)) {
+            printf("Expected parameter name!\n");
+            exit(1);
+        }
+        add_child(params, create_identifier(peekToken(0)->lexeme));
+        nextToken();
+        checkToken(TOK_COLON);
+        if (!matchTokens(TOK_TYPE_INT)) {
+            printf("Only INTEGER parameters are supported!\n");
+            exit(1);
+        }
+        nextToken();
+    }
+    nextToken();
+    if (type == NODE_FUNCTION) {
+        checkToken(TOK_RETURNS);
+        if (!matchTokens(TOK_TYPE_INT)) {
+            printf("Only INTEGER return values are supported!\n");
+            exit(1);
+        }
+        nextToken();
+    }
+    checkToken(TOK_END);
+    return node;
+}
+
+ASTNode* parse_return(void) {
+    ASTNode* node = new_node(NODE_RETURN);
+    add_child(node, parse_exp());
+    checkToken(TOK_END);
+    return node;
+}
+
+ASTNode* parse_call(void) {
+    if (!matchTokens(TOK_IDENTIFIER)) {
+        printf("Expected Identifier after CALL!\n");
+        exit(1);
+    }
+    ASTNode* call = create_call(NODE_CALL_STMT, peekToken(0)->lexeme);
+    nextToken();
+    parse_arguments(call);
+    checkToken(TOK_END);
+    return call;
+}
+
+// PARALLEL FOR i <- first TO last, then any number of SUM x, MIN x or MAX x
+// naming the reductions. SUM, MIN and MAX are only special here.
+ASTNode* parse_parallel_for(void) {
+    checkToken(TOK_FOR);
+    if (!matchTokens(TOK_IDENTIFIER)) {
+        printf("Expected loop variable after PARALLEL FOR!\n");
+        exit(1);
+    }
+    ASTNode* loop = create_call(NODE_PARALLEL_FOR, peekToken(0)->lexeme);
+    nextToken();
+    checkToken(TOK_ASSIGN);
+    add_child(loop, parse_operand());
+    checkToken(TOK_TO);
+    add_child(loop, parse_operand());
+    ASTNode* reductions = new_node(NODE_REDUCTIONS);
+    add_child(loop, reductions);
+    while (!matchTokens(TOK_END)) {
+        const char* kinds[] = {"SUM", "MIN", "MAX"};
+        int kind = 0;
+        while (kind < 3 && !(matchTokens(TOK_IDENTIFIER) && !strcmp(peekToken(0)->lexeme, kinds[kind]))) { kind++; }
+        if (kind == 3 || peekToken(1)->type != TOK_IDENTIFIER) {
+            printf("Expected SUM, MIN or MAX and a variable after TO!\n");
+            exit(1);
+        }
+        nextToken();
+        ASTNode* reduction = new_node(NODE_REDUCTION);
+        reduction->data.value = kind;
+        add_child(reduction, create_identifier(peekToken(0)->lexeme));
+        add_child(reductions, reduction);
+        nextToken();
+    }
+    checkToken(TOK_END);
+    return loop;
+}
+
 void free_tokens(Token* tokens, int count) {
     for (int i = 0; i < count; i++) {
         if (tokens[i].lexeme != NULL) {
@@ -440,7 +813,9 @@ void free_tokens(Token* tokens, int count) {
 
 ASTNode* parse_statement(char* statement) {
     ASTNode* result = NULL;
+    statsEnter("lex");
     token_count = tokenize(statement, tokens, 100);
+    statsEnter("parse");
     current_token = 0;
     if (token_count == 0) { return NULL; }
     if (matchTokens(TOK_DECLARE)) {
@@ -451,7 +826,38 @@ ASTNode* parse_statement(char* statement) {
     } else if (matchTokens(TOK_OUTPUT)) {
         nextToken();
         result = parse_output();
+    } else if (matchTokens(TOK_FUNCTION) || matchTokens(TOK_PROCEDURE)) {
+        NodeType type = matchTokens(TOK_FUNCTION) ? NODE_FUNCTION : NODE_PROCEDURE;
+        nextToken();
+        result = parse_subroutine(type);
+    } else if (matchTokens(TOK_ENDFUNCTION) || matchTokens(TOK_ENDPROCEDURE)) {
+        result = new_node(matchTokens(TOK_ENDFUNCTION) ? NODE_END_FUNCTION : NODE_END_PROCEDURE);
+        nextToken();
+        checkToken(TOK_END);
+    } else if (matchTokens(TOK_RETURN)) {
+        nextToken();
+        result = parse_return();
+    } else if (matchTokens(TOK_CALL)) {
+        nextToken();
+        result = parse_call();
+    } else if (matchTokens(TOK_CHECKPOINT)) {
+        result = new_node(NODE_CHECKPOINT);
+        nextToken();
+        checkToken(TOK_END);
+    } else if (matchTokens(TOK_PARALLEL)) {
+        nextToken();
+        result = parse_parallel_for();
+    } else if (matchTokens(TOK_NEXT)) {
+        nextToken();
+        if (!matchTokens(TOK_IDENTIFIER)) {
+            printf("Expected loop variable after NEXT!\n");
+            exit(1);
+        }
+        result = create_call(NODE_NEXT, peekToken(0)->lexeme);
+        nextToken();
+        checkToken(TOK_END);
     } else if (matchTokens(TOK_END)) {
+        free_tokens(tokens, token_count);
         return NULL;
     } else {
         printf("Invalid Statement!\n");
@@ -474,6 +880,7 @@ const char* opname(OpType op) {
         case SUB: return "-";
         case MUL: return "*";
         case DIV: return "/";
+        case CAT: return "&";
         default:  return "?";
     }
 }
@@ -483,6 +890,7 @@ const char* vartype(VarType t) {
         case INT: return "int";
         case REAL: return "real";
         case CHAR: return "char";
+        case STR: return "string";
         default:   return "?";
     }
 }
@@ -530,6 +938,62 @@ void print_ast(ASTNode* node, int indent) {
         case NODE_LITERAL:
             printf("Literal(%s)\n", node->data.name);
             break;
+        case NODE_ARRAY_DECL:
+            printf("ArrayDecl(type=%s, %d:%d)\n", vartype(node->data.var_type),
+                   node->children[1]->data.value, node->children[2]->data.value);
+            print_ast(node->children[0], indent + 1);
+            break;
+        case NODE_INDEX:
+            printf("Index\n");
+            for (int i = 0; i < node->child_count; i++) {
+                print_ast(node->children[i], indent + 1);
+            }
+            break;
+        case NODE_FUNCTION:
+        case NODE_PROCEDURE:
+            printf("%s(%s)\n", node->type == NODE_FUNCTION ? "Function" : "Procedure", node->data.name);
+            for (int i = 0; i < node->child_count; i++) {
+                print_ast(node->children[i], indent + 1);
+            }
+            break;
+        case NODE_PARAMS:
+            printf("Params\n");
+            for (int i = 0; i < node->child_count; i++) {
+                print_ast(node->children[i], indent + 1);
+            }
+            break;
+        case NODE_RETURN:
+            printf("Return\n");
+            print_ast(node->children[0], indent + 1);
+            break;
+        case NODE_CHECKPOINT:
+            printf("Checkpoint\n");
+            break;
+        case NODE_PARALLEL_FOR:
+            printf("ParallelFor(%s)\n", node->data.name);
+            for (int i = 0; i < node->child_count; i++) {
+                print_ast(node->children[i], indent + 1);
+            }
+            break;
+        case NODE_REDUCTIONS:
+            printf("Reductions\n");
+            for (int i = 0; i < node->child_count; i++) {
+                print_ast(node->children[i], indent + 1);
+            }
+            break;
+        case NODE_REDUCTION: {
+            const char* kinds[] = {"SUM", "MIN", "MAX"};
+            printf("Reduction(%s)\n", kinds[node->data.value]);
+            print_ast(node->children[0], indent + 1);
+            break;
+        }
+        case NODE_CALL:
+        case NODE_CALL_STMT:
+            printf("Call(%s)\n", node->data.name);
+            for (int i = 0; i < node->child_count; i++) {
+                print_ast(node->children[i], indent + 1);
+            }
+            break;
         default:
             printf("UnknownNode\n");
             break;
@@ -537,82 +1001,1513 @@ void print_ast(ASTNode* node, int indent) {
 }
 //===============================================================================
 
+
+// SSA IR
+//=======================
+// The language has no control flow yet, so a program lowers to a single
+// basic block. Every definition creates a new SSA value; user variables keep
+// their name so the emitter can map values back onto their home slots.
+typedef enum {
+    IR_DECL,
+    IR_COPY,
+    IR_BINOP,
+    IR_OUTPUT,
+    IR_ARRAY_DECL,      // args: lower and upper bound
+    IR_ALOAD,           // dst = name[args[0]]
+    IR_ASTORE,          // name[args[0]] = args[1]
+    IR_CALL,            // dst = name(call_args), dst is -1 for a procedure
+    IR_RETURN,          // return args[0]
+    IR_CHECKPOINT,      // the VM may snapshot its state here
+    IR_PFOR,            // run kernel name for args[0]..args[1], shared values in call_args
+    IR_REDUCE,          // contribute args[0] to reduction args[1], name is its kind
+    IR_MERGE            // dst = args[0] folded with reduction args[1] of the last IR_PFOR
+} IROpcode;
+
+typedef enum {
+    OPND_NONE,
+    OPND_CONST,
+    OPND_VALUE,
+    OPND_STRING
+} OperandKind;
+
+typedef struct {
+    OperandKind kind;
+    int value;          // literal for OPND_CONST, SSA value id for OPND_VALUE,
+                        // string_consts index for OPND_STRING
+} IROperand;
+
+typedef struct {
+    IROpcode op;
+    OpType bin_op;
+    int dst;            // SSA value defined here, -1 if none
+    IROperand args[2];
+    IROperand* call_args; // operand slots 2.. for IR_CALL
+    int call_argc;
+    char* name;         // declared variable, array or callee
+    bool checked;       // array access still needs a bounds check
+    bool dead;
+} IRInstr;
+
+typedef struct {
+    int instr;
+    int slot;           // operand slot, see operand_at
+} IRUse;
+
+typedef struct {
+    char* var;          // user variable holding this value, NULL for temporaries
+    int temp;           // temporary number when var is NULL
+    int def;            // defining instruction, -1 for a variable's entry value
+    IRUse* uses;        // def-use chain
+    int use_count;
+    int use_capacity;
+    int live_uses;
+    bool is_string;     // holds a string handle rather than an integer
+    long long lo, hi;   // value range from range_analysis
+} SSAValue;
+
+typedef struct {
+    IRInstr* instrs;
+    int count;
+    int capacity;
+} BasicBlock;
+
+BasicBlock main_block = {NULL, 0, 0};
+BasicBlock* block = &main_block;
+SSAValue* values = NULL;
+int value_count = 0;
+int value_capacity = 0;
+
+typedef struct {
+    char* name;
+    int value;
+} VarDef;
+
+VarDef* var_defs = NULL;
+int var_def_count = 0;
+
 int tempVars = 0;
 
-char* new_temp() {
-    char* buf = malloc(10);
-    sprintf(buf, "t%d", tempVars++);
-    return buf;
+int new_value(char* var) {
+    if (value_count == value_capacity) {
+        value_capacity = value_capacity ? value_capacity * 2 : 64;
+        values = realloc(values, sizeof(SSAValue) * value_capacity);
+    }
+    SSAValue* v = &values[value_count];
+    v->var = var;
+    v->temp = var ? -1 : tempVars++;
+    v->def = -1;
+    v->uses = NULL;
+    v->use_count = 0;
+    v->use_capacity = 0;
+    v->live_uses = 0;
+    v->is_string = false;
+    v->lo = -2147483647LL - 1;
+    v->hi = 2147483647LL;
+    return value_count++;
 }
 
-char* construct_ir(ASTNode* node, FILE* ir_file) {
-    switch (node->type) {
-        case NODE_PROGRAM:
-            for (int i = 0; i < node->child_count; i++)
-                construct_ir(node->children[i], ir_file);
-            return NULL;
+void add_use(int value, int instr, int slot) {
+    SSAValue* v = &values[value];
+    if (v->use_count == v->use_capacity) {
+        v->use_capacity = v->use_capacity ? v->use_capacity * 2 : 4;
+        v->uses = realloc(v->uses, sizeof(IRUse) * v->use_capacity);
+    }
+    v->uses[v->use_count].instr = instr;
+    v->uses[v->use_count++].slot = slot;
+    v->live_uses++;
+}
 
-        case NODE_VAR_DECL: {
-            ASTNode* id = node->children[0];
-            fprintf(ir_file, "%s\n", id->data.name);
-            return NULL;
-        }
-        case NODE_OUTPUT:
-            fprintf(ir_file, "output %s\n", construct_ir(node->children[0], ir_file));
-            return NULL;
-        case NODE_ASSIGN:
-            char* right = construct_ir(node->children[1], ir_file);
-            fprintf(ir_file, "%s = %s\n",node->children[0]->data.name, right);
-            return NULL;
-        case NODE_BINARY_OP: {
-            char* lhs = construct_ir(node->children[0], ir_file);
-            char* rhs = construct_ir(node->children[1], ir_file);
-            char* tmp = new_temp();
-            fprintf(ir_file, "%s = %s %s %s\n",tmp, lhs, opname(node->data.op), rhs);
-            return tmp; break;
-        }
-        case NODE_IDENTIFIER:
-            return node->data.name;
-        case NODE_NUMBER: {
-            char *tmp_num = malloc(10);
-            sprintf(tmp_num, "%d", node->data.value);
-            return tmp_num;
-        }
-        default:
-            printf("Error Generating IR!: Unrecognized Token Node");
-            exit(1);
-            break;
+// Slots 0 and 1 are args; a call's arguments follow from slot 2.
+int operand_count(IRInstr* in) {
+    return 2 + in->call_argc;
+}
+
+IROperand* operand_at(IRInstr* in, int slot) {
+    return slot < 2 ? &in->args[slot] : &in->call_args[slot - 2];
+}
+
+int emit_instr(IROpcode op, int dst, IROperand a, IROperand b) {
+    if (block->count == block->capacity) {
+        block->capacity = block->capacity ? block->capacity * 2 : 64;
+        block->instrs = realloc(block->instrs, sizeof(IRInstr) * block->capacity);
     }
+    int idx = block->count++;
+    IRInstr* in = &block->instrs[idx];
+    in->op = op;
+    in->bin_op = ADD;
+    in->dst = dst;
+    in->args[0] = a;
+    in->args[1] = b;
+    in->call_args = NULL;
+    in->call_argc = 0;
+    in->name = NULL;
+    in->checked = true;
+    in->dead = false;
+    if (dst >= 0) { values[dst].def = idx; }
+    if (a.kind == OPND_VALUE) { add_use(a.value, idx, 0); }
+    if (b.kind == OPND_VALUE) { add_use(b.value, idx, 1); }
+    return idx;
 }
 
+// Nonzero while a function body is being lowered into its caller.
+int inline_depth = 0;
 
-int main(int argc, char* argv[]) {
-    if (argc < 2) {
-        printf("Usage: %s <source.pseu>\n", argv[0]);
-        return 1;
+// String literals, interned; an OPND_STRING operand indexes this table.
+char** string_consts = NULL;
+int string_const_count = 0;
+
+int intern_string(const char* text) {
+    for (int i = 0; i < string_const_count; i++) {
+        if (!strcmp(string_consts[i], text)) { return i; }
     }
+    string_consts = realloc(string_consts, sizeof(char*) * (string_const_count + 1));
+    string_consts[string_const_count] = _strdup(text);
+    return string_const_count++;
+}
 
-    char str[256];
-    FILE* file = fopen(argv[1], "r");
-    if (!file) {
-        perror("fopen");
-        return 1;
+IROperand string_operand(const char* text) {
+    IROperand o = {OPND_STRING, intern_string(text)};
+    return o;
+}
+
+// Variables declared STRING in the current scope; everything else is INTEGER.
+char** string_vars = NULL;
+int string_var_count = 0;
+
+bool is_string_var(char* name) {
+    for (int i = 0; i < string_var_count; i++) {
+        if (!strcmp(string_vars[i], name)) { return true; }
     }
+    return false;
+}
 
-    ASTNode* program = new_node(NODE_PROGRAM);
+void declare_string(char* name) {
+    if (is_string_var(name)) { return; }
+    string_vars = realloc(string_vars, sizeof(char*) * (string_var_count + 1));
+    string_vars[string_var_count++] = _strdup(name);
+}
 
-    while (fgets(str, sizeof(str), file)) {
-        ASTNode* stmt = parse_statement(str);
-        if (stmt) {
-            add_child(program, stmt);
-        }
+void free_string_vars(void) {
+    for (int i = 0; i < string_var_count; i++) { free(string_vars[i]); }
+    free(string_vars);
+}
+
+bool is_string_operand(IROperand o) {
+    return o.kind == OPND_STRING || (o.kind == OPND_VALUE && values[o.value].is_string);
+}
+
+void expect_integer(IROperand o, const char* what) {
+    if (is_string_operand(o)) {
+        printf("STRING used as %s!\n", what);
+        exit(1);
     }
+}
 
-    FILE* ir_file = fopen(argv[2], "w");
-    construct_ir(program, ir_file);
-    fclose(ir_file);
+// Current SSA definition of a user variable; reading a variable before any
+// assignment yields its entry value, i.e. whatever the slot starts with.
+// Locals of an inlined body have no slot and start at zero instead.
+// Variables assigned in a PARALLEL FOR body, which only held per-iteration
+// values; the main code may not read one until it assigns it again.
+char** private_vars = NULL;
+char** private_loops = NULL;
+int private_count = 0;
+
+int find_private(char* name) {
+    for (int i = 0; i < private_count; i++) {
+        if (!strcmp(private_vars[i], name)) { return i; }
+    }
+    return -1;
+}
 
+int read_var(char* name) {
+    int p = block == &main_block && !inline_depth ? find_private(name) : -1;
+    if (p >= 0) {
+        printf("%s is private to PARALLEL FOR %s and is not set after it; make it a SUM, MIN or MAX reduction!\n",
+               name, private_loops[p]);
+        exit(1);
+    }
+    for (int i = 0; i < var_def_count; i++) {
+        if (!strcmp(var_defs[i].name, name)) { return var_defs[i].value; }
+    }
+    int value = new_value(inline_depth ? NULL : name);
+    values[value].is_string = is_string_var(name);
+    if (inline_depth) {
+        IROperand zero = {OPND_CONST, 0};
+        IROperand none = {OPND_NONE, 0};
+        emit_instr(IR_COPY, value, values[value].is_string ? string_operand("") : zero, none);
+    }
+    var_defs = realloc(var_defs, sizeof(VarDef) * (var_def_count + 1));
+    var_defs[var_def_count].name = name;
+    var_defs[var_def_count].value = value;
+    return var_defs[var_def_count++].value;
+}
+
+void write_var(char* name, int value) {
+    int p = block == &main_block && !inline_depth ? find_private(name) : -1;
+    if (p >= 0) {
+        free(private_vars[p]);
+        free(private_loops[p]);
+        private_vars[p] = private_vars[--private_count];
+        private_loops[p] = private_loops[private_count];
+    }
+    for (int i = 0; i < var_def_count; i++) {
+        if (!strcmp(var_defs[i].name, name)) {
+            var_defs[i].value = value;
+            return;
+        }
+    }
+    var_defs = realloc(var_defs, sizeof(VarDef) * (var_def_count + 1));
+    var_defs[var_def_count].name = name;
+    var_defs[var_def_count++].value = value;
+}
+
+IROperand const_operand(int value) {
+    IROperand o = {OPND_CONST, value};
+    return o;
+}
+
+IROperand value_operand(int value) {
+    IROperand o = {OPND_VALUE, value};
+    return o;
+}
+
+IROperand no_operand(void) {
+    IROperand o = {OPND_NONE, 0};
+    return o;
+}
+
+typedef struct {
+    char* name;
+    int lower;
+    int upper;
+} ArrayInfo;
+
+ArrayInfo* arrays = NULL;
+int array_count = 0;
+
+ArrayInfo* find_array(char* name) {
+    for (int i = 0; i < array_count; i++) {
+        if (!strcmp(arrays[i].name, name)) { return &arrays[i]; }
+    }
+    return NULL;
+}
+
+ArrayInfo* expect_array(char* name) {
+    ArrayInfo* array = find_array(name);
+    if (!array) {
+        printf("%s is not an array!\n", name);
+        exit(1);
+    }
+    return array;
+}
+
+void expect_scalar(char* name) {
+    if (find_array(name)) {
+        printf("Array %s used without an index!\n", name);
+        exit(1);
+    }
+}
+
+// Subroutines
+//=======================
+// A subroutine is lowered into its own block and emitted as a
+// function/procedure section, unless it is small and not recursive, in which
+// case from -O1 on every call is lowered straight into the caller instead.
+#define INLINE_MAX_NODES 32
+
+typedef struct {
+    char* name;
+    char** params;
+    int param_count;
+    bool returns;
+    bool inlinable;
+    bool emitted;
+    bool pure;          // a PARALLEL FOR may call it, see block_is_pure
+    bool kernel;        // body of a PARALLEL FOR, see lower_parallel_for
+    int reduction_count;
+    char** reads;       // arrays it or any subroutine it calls loads from
+    int read_count;
+    char** writes;      // and stores to
+    int write_count;
+    ASTNode* def;       // only kept for inlinable subroutines
+    BasicBlock block;
+} FunctionInfo;
+
+FunctionInfo* functions = NULL;
+int function_count = 0;
+int opt_level = 0;
+
+FunctionInfo* find_function(char* name) {
+    for (int i = 0; i < function_count; i++) {
+        if (!strcmp(functions[i].name, name)) { return &functions[i]; }
+    }
+    return NULL;
+}
+
+int count_nodes(ASTNode* node) {
+    int n = 1;
+    for (int i = 0; i < node->child_count; i++) { n += count_nodes(node->children[i]); }
+    return n;
+}
+
+bool calls_function(ASTNode* node, char* name) {
+    if ((node->type == NODE_CALL || node->type == NODE_CALL_STMT) && !strcmp(node->data.name, name)) {
+        return true;
+    }
+    for (int i = 0; i < node->child_count; i++) {
+        if (calls_function(node->children[i], name)) { return true; }
+    }
+    return false;
+}
+
+IROperand construct_ir(ASTNode* node);
+
+// True if the code in b writes no output, touches no string and only calls
+// such subroutines or self; with an empty write set, running it on several
+// threads at once cannot race.
+bool block_is_pure(BasicBlock* b, char* self) {
+    for (int i = 0; i < b->count; i++) {
+        IRInstr* in = &b->instrs[i];
+        if (in->op == IR_OUTPUT || (in->dst >= 0 && values[in->dst].is_string)) {
+            return false;
+        }
+        for (int a = 0; a < operand_count(in); a++) {
+            if (is_string_operand(*operand_at(in, a))) { return false; }
+        }
+        if (in->op == IR_CALL && strcmp(in->name, self) && !find_function(in->name)->pure) { return false; }
+    }
+    return true;
+}
+
+void add_array(char*** set, int* count, char* name) {
+    for (int i = 0; i < *count; i++) {
+        if (!strcmp((*set)[i], name)) { return; }
+    }
+    *set = realloc(*set, sizeof(char*) * (*count + 1));
+    (*set)[(*count)++] = name;
+}
+
+// Fills the read and write sets of fn from its block; a callee is defined
+// before its callers, so its sets are already complete.
+void collect_arrays(FunctionInfo* fn) {
+    for (int i = 0; i < fn->block.count; i++) {
+        IRInstr* in = &fn->block.instrs[i];
+        if (in->op == IR_ALOAD) { add_array(&fn->reads, &fn->read_count, in->name); }
+        if (in->op == IR_ASTORE) { add_array(&fn->writes, &fn->write_count, in->name); }
+        if (in->op != IR_CALL || !strcmp(in->name, fn->name)) { continue; }
+        FunctionInfo* callee = find_function(in->name);
+        for (int r = 0; r < callee->read_count; r++) { add_array(&fn->reads, &fn->read_count, callee->reads[r]); }
+        for (int w = 0; w < callee->write_count; w++) { add_array(&fn->writes, &fn->write_count, callee->writes[w]); }
+    }
+}
+
+void lower_function(FunctionInfo* fn, ASTNode* def) {
+    BasicBlock* saved_block = block;
+    VarDef* saved_defs = var_defs;
+    int saved_def_count = var_def_count;
+    char** saved_strings = string_vars;
+    int saved_string_count = string_var_count;
+    block = &fn->block;
+    var_defs = NULL;
+    var_def_count = 0;
+    string_vars = NULL;
+    string_var_count = 0;
+    // parameters are the entry values of their slots
+    for (int i = 0; i < fn->param_count; i++) { read_var(fn->params[i]); }
+    for (int i = 1; i < def->child_count; i++) { construct_ir(def->children[i]); }
+    free(var_defs);
+    free_string_vars();
+    var_defs = saved_defs;
+    var_def_count = saved_def_count;
+    string_vars = saved_strings;
+    string_var_count = saved_string_count;
+    block = saved_block;
+}
+
+void register_function(ASTNode* def) {
+    if (find_function(def->data.name)) {
+        printf("Subroutine %s defined twice!\n", def->data.name);
+        exit(1);
+    }
+    functions = realloc(functions, sizeof(FunctionInfo) * (function_count + 1));
+    FunctionInfo* fn = &functions[function_count++];
+    ASTNode* params = def->children[0];
+    fn->name = _strdup(def->data.name);
+    fn->param_count = params->child_count;
+    fn->params = malloc(sizeof(char*) * (params->child_count ? params->child_count : 1));
+    for (int i = 0; i < params->child_count; i++) {
+        fn->params[i] = _strdup(params->children[i]->data.name);
+    }
+    fn->returns = def->type == NODE_FUNCTION;
+    fn->inlinable = opt_level >= 1 && !calls_function(def, def->data.name)
+                    && count_nodes(def) <= INLINE_MAX_NODES;
+    fn->emitted = false;
+    fn->kernel = false;
+    fn->reduction_count = 0;
+    fn->reads = fn->writes = NULL;
+    fn->read_count = fn->write_count = 0;
+    fn->def = fn->inlinable ? def : NULL;
+    fn->block.instrs = NULL;
+    fn->block.count = 0;
+    fn->block.capacity = 0;
+    // an inlined body is checked where it lands
+    fn->pure = true;
+    if (!fn->inlinable) {
+        lower_function(fn, def);
+        collect_arrays(fn);
+        fn->pure = fn->write_count == 0 && block_is_pure(&fn->block, fn->name);
+    }
+}
+
+// Binds the parameters to the argument values and lowers the body in a
+// fresh scope; the RETURN expression becomes the value of the call.
+IROperand inline_call(FunctionInfo* fn, IROperand* args) {
+    VarDef* saved_defs = var_defs;
+    int saved_def_count = var_def_count;
+    char** saved_strings = string_vars;
+    int saved_string_count = string_var_count;
+    var_defs = NULL;
+    var_def_count = 0;
+    string_vars = NULL;
+    string_var_count = 0;
+    for (int i = 0; i < fn->param_count; i++) {
+        int value;
+        if (args[i].kind == OPND_VALUE) {
+            value = args[i].value;
+        } else {
+            value = new_value(NULL);
+            emit_instr(IR_COPY, value, args[i], no_operand());
+        }
+        write_var(fn->params[i], value);
+    }
+    inline_depth++;
+    IROperand result = no_operand();
+    for (int i = 1; i < fn->def->child_count; i++) {
+        ASTNode* stmt = fn->def->children[i];
+        if (stmt->type == NODE_RETURN) {
+            result = construct_ir(stmt->children[0]);
+            expect_integer(result, "a return value");
+        } else {
+            construct_ir(stmt);
+        }
+    }
+    inline_depth--;
+    free(var_defs);
+    free_string_vars();
+    var_defs = saved_defs;
+    var_def_count = saved_def_count;
+    string_vars = saved_strings;
+    string_var_count = saved_string_count;
+    return result;
+}
+
+IROperand lower_call(ASTNode* node) {
+    FunctionInfo* fn = find_function(node->data.name);
+    if (!fn) {
+        printf("Unknown subroutine %s!\n", node->data.name);
+        exit(1);
+    }
+    if (node->type == NODE_CALL && !fn->returns) {
+        printf("Procedure %s does not return a value!\n", fn->name);
+        exit(1);
+    }
+    if (node->type == NODE_CALL_STMT && fn->returns) {
+        printf("Function %s must be used in an expression, not with CALL!\n", fn->name);
+        exit(1);
+    }
+    int argc = node->child_count;
+    if (argc != fn->param_count) {
+        printf("%s expects %d arguments, got %d!\n", fn->name, fn->param_count, argc);
+        exit(1);
+    }
+    IROperand* args = malloc(sizeof(IROperand) * (argc ? argc : 1));
+    for (int i = 0; i < argc; i++) {
+        args[i] = construct_ir(node->children[i]);
+        expect_integer(args[i], "an argument");
+    }
+    if (fn->inlinable) {
+        IROperand result = inline_call(fn, args);
+        free(args);
+        return result;
+    }
+    int dst = fn->returns ? new_value(NULL) : -1;
+    int idx = emit_instr(IR_CALL, dst, no_operand(), no_operand());
+    IRInstr* in = &block->instrs[idx];
+    in->name = fn->name;
+    in->call_args = args;
+    in->call_argc = argc;
+    for (int i = 0; i < argc; i++) {
+        if (args[i].kind == OPND_VALUE) { add_use(args[i].value, idx, 2 + i); }
+    }
+    return dst >= 0 ? value_operand(dst) : no_operand();
+}
+
+// PARALLEL FOR
+//=======================
+// The body is lowered into a kernel, a subroutine the VM runs once per
+// iteration on several threads, so no iteration may depend on another.
+// Variables assigned in the body are private to an iteration and start at
+// zero, and reading one after the loop is an error rather than a silent
+// zero; every other variable is read-only and passed to the kernel after the
+// loop variable. An array written in the body may only be indexed by the
+// loop variable. Assigning a reduction variable contributes to its SUM, MIN
+// or MAX instead; after the loop it holds its old value folded with every
+// contribution, which does not depend on how the range was split.
+ASTNode* lowering_loop = NULL;      // loop whose body is being lowered
+int loop_count = 0;
+
+const char* reduce_names[] = {"sum", "min", "max"};
+
+int find_reduction(ASTNode* loop, char* name) {
+    ASTNode* reductions = loop->children[2];
+    for (int k = 0; k < reductions->child_count; k++) {
+        if (!strcmp(reductions->children[k]->children[0]->data.name, name)) { return k; }
+    }
+    return -1;
+}
+
+// The operand a chain of copies in the current block started from
+IROperand copy_source(IROperand o) {
+    while (o.kind == OPND_VALUE && values[o.value].def >= 0 && block->instrs[values[o.value].def].op == IR_COPY) {
+        o = block->instrs[values[o.value].def].args[0];
+    }
+    return o;
+}
+
+bool assigned_in_body(char* name) {
+    for (int i = 0; i < var_def_count; i++) {
+        if (!strcmp(var_defs[i].name, name)) { return values[var_defs[i].value].def >= 0; }
+    }
+    return false;
+}
+
+bool written_in_body(char* array) {
+    for (int i = 0; i < block->count; i++) {
+        if (block->instrs[i].op == IR_ASTORE && !strcmp(block->instrs[i].name, array)) { return true; }
+    }
+    return false;
+}
+
+bool indexed_by(IRInstr* in, int index) {
+    IROperand at = copy_source(in->args[0]);
+    return at.kind == OPND_VALUE && at.value == index;
+}
+
+// Checks the kernel body in the current block and makes the variables it
+// reads its parameters, loop variable first.
+void check_kernel(FunctionInfo* kernel, ASTNode* loop, int index, int first_value) {
+    kernel->params = malloc(sizeof(char*));
+    kernel->params[0] = _strdup(loop->data.name);
+    kernel->param_count = 1;
+    for (int v = first_value; v < value_count; v++) {
+        if (v == index || values[v].def >= 0 || !values[v].var) { continue; }
+        if (assigned_in_body(values[v].var)) {
+            printf("%s is read before it is assigned in PARALLEL FOR %s!\n", values[v].var, loop->data.name);
+            exit(1);
+        }
+        kernel->params = realloc(kernel->params, sizeof(char*) * (kernel->param_count + 1));
+        kernel->params[kernel->param_count++] = _strdup(values[v].var);
+    }
+    for (int i = 0; i < block->count; i++) {
+        IRInstr* in = &block->instrs[i];
+        bool strings = in->dst >= 0 && values[in->dst].is_string;
+        for (int a = 0; a < operand_count(in); a++) {
+            strings = strings || is_string_operand(*operand_at(in, a));
+        }
+        if (strings) {
+            printf("STRING values cannot be used in PARALLEL FOR!\n");
+            exit(1);
+        }
+        if (in->op == IR_OUTPUT) {
+            printf("OUTPUT inside PARALLEL FOR!\n");
+            exit(1);
+        }
+        if (in->op == IR_CALL && !find_function(in->name)->pure) {
+            printf("%s cannot be called in PARALLEL FOR: it writes arrays, output or strings!\n", in->name);
+            exit(1);
+        }
+        // a callee may read any element, including another iteration's
+        if (in->op == IR_CALL) {
+            FunctionInfo* callee = find_function(in->name);
+            for (int r = 0; r < callee->read_count; r++) {
+                if (written_in_body(callee->reads[r])) {
+                    printf("%s cannot be called in PARALLEL FOR: it reads array %s, which the loop writes!\n",
+                           in->name, callee->reads[r]);
+                    exit(1);
+                }
+            }
+        }
+        if (in->op != IR_ALOAD && in->op != IR_ASTORE) { continue; }
+        if (written_in_body(in->name) && !indexed_by(in, index)) {
+            printf("Array %s is written in PARALLEL FOR, so it must be indexed by %s!\n", in->name, loop->data.name);
+            exit(1);
+        }
+    }
+}
+
+IROperand lower_parallel_for(ASTNode* loop) {
+    char* var = loop->data.name;
+    ASTNode* reductions = loop->children[2];
+    expect_scalar(var);
+    if (is_string_var(var)) {
+        printf("Loop variable %s must be an INTEGER!\n", var);
+        exit(1);
+    }
+    for (int k = 0; k < reductions->child_count; k++) {
+        char* name = reductions->children[k]->children[0]->data.name;
+        expect_scalar(name);
+        if (!strcmp(name, var) || is_string_var(name) || find_reduction(loop, name) != k) {
+            printf("Invalid reduction variable %s!\n", name);
+            exit(1);
+        }
+    }
+    IROperand first = construct_ir(loop->children[0]);
+    IROperand last = construct_ir(loop->children[1]);
+    expect_integer(first, "a loop bound");
+    expect_integer(last, "a loop bound");
+    IROperand first_const = copy_source(first);
+    IROperand last_const = copy_source(last);
+
+    functions = realloc(functions, sizeof(FunctionInfo) * (function_count + 1));
+    FunctionInfo* kernel = &functions[function_count++];
+    char name[32];
+    sprintf(name, "for.%d", loop_count++);
+    kernel->name = _strdup(name);
+    kernel->returns = false;
+    kernel->inlinable = false;
+    kernel->emitted = false;
+    kernel->pure = false;
+    kernel->kernel = true;
+    kernel->reduction_count = reductions->child_count;
+    kernel->reads = kernel->writes = NULL;
+    kernel->read_count = kernel->write_count = 0;
+    kernel->def = NULL;
+    kernel->block.instrs = NULL;
+    kernel->block.count = 0;
+    kernel->block.capacity = 0;
+
+    BasicBlock* saved_block = block;
+    VarDef* saved_defs = var_defs;
+    int saved_def_count = var_def_count;
+    block = &kernel->block;
+    var_defs = NULL;
+    var_def_count = 0;
+    int first_value = value_count;
+    int index = read_var(var);
+    if (first_const.kind == OPND_CONST && last_const.kind == OPND_CONST && first_const.value <= last_const.value) {
+        values[index].lo = first_const.value;
+        values[index].hi = last_const.value;
+    }
+    lowering_loop = loop;
+    for (int i = 3; i < loop->child_count; i++) { construct_ir(loop->children[i]); }
+    lowering_loop = NULL;
+    check_kernel(kernel, loop, index, first_value);
+    for (int i = 0; i < var_def_count; i++) {
+        if (values[var_defs[i].value].def < 0 || find_private(var_defs[i].name) >= 0) { continue; }
+        private_vars = realloc(private_vars, sizeof(char*) * (private_count + 1));
+        private_loops = realloc(private_loops, sizeof(char*) * (private_count + 1));
+        private_vars[private_count] = _strdup(var_defs[i].name);
+        private_loops[private_count++] = _strdup(var);
+    }
+    free(var_defs);
+    var_defs = saved_defs;
+    var_def_count = saved_def_count;
+    block = saved_block;
+
+    int argc = kernel->param_count - 1;
+    IROperand* args = malloc(sizeof(IROperand) * (argc ? argc : 1));
+    for (int i = 0; i < argc; i++) { args[i] = value_operand(read_var(kernel->params[i + 1])); }
+    int idx = emit_instr(IR_PFOR, -1, first, last);
+    IRInstr* in = &block->instrs[idx];
+    in->name = kernel->name;
+    in->call_args = args;
+    in->call_argc = argc;
+    for (int i = 0; i < argc; i++) { add_use(args[i].value, idx, 2 + i); }
+    for (int k = 0; k < reductions->child_count; k++) {
+        char* target = reductions->children[k]->children[0]->data.name;
+        IROperand before = value_operand(read_var(target));
+        int dst = new_value(target);
+        emit_instr(IR_MERGE, dst, before, const_operand(k));
+        write_var(target, dst);
+    }
+    return no_operand();
+}
+
+IROperand construct_ir(ASTNode* node) {
+    switch (node->type) {
+        case NODE_PROGRAM:
+            for (int i = 0; i < node->child_count; i++)
+                construct_ir(node->children[i]);
+            return no_operand();
+
+        case NODE_VAR_DECL: {
+            if (node->data.var_type == STR) { declare_string(node->children[0]->data.name); }
+            if (inline_depth) { return no_operand(); }
+            int idx = emit_instr(IR_DECL, -1, no_operand(), no_operand());
+            block->instrs[idx].name = node->children[0]->data.name;
+            return no_operand();
+        }
+        case NODE_OUTPUT:
+            emit_instr(IR_OUTPUT, -1, construct_ir(node->children[0]), no_operand());
+            return no_operand();
+        case NODE_ARRAY_DECL: {
+            char* name = node->children[0]->data.name;
+            if (find_array(name)) {
+                printf("Array %s declared twice!\n", name);
+                exit(1);
+            }
+            arrays = realloc(arrays, sizeof(ArrayInfo) * (array_count + 1));
+            arrays[array_count].name = _strdup(name);
+            arrays[array_count].lower = node->children[1]->data.value;
+            arrays[array_count].upper = node->children[2]->data.value;
+            array_count++;
+            int idx = emit_instr(IR_ARRAY_DECL, -1, const_operand(node->children[1]->data.value),
+                                 const_operand(node->children[2]->data.value));
+            block->instrs[idx].name = arrays[array_count - 1].name;
+            return no_operand();
+        }
+        case NODE_INDEX: {
+            ArrayInfo* array = expect_array(node->children[0]->data.name);
+            IROperand index = construct_ir(node->children[1]);
+            expect_integer(index, "an array index");
+            int dst = new_value(NULL);
+            int idx = emit_instr(IR_ALOAD, dst, index, no_operand());
+            block->instrs[idx].name = array->name;
+            return value_operand(dst);
+        }
+        case NODE_ASSIGN: {
+            if (node->children[0]->type == NODE_INDEX) {
+                ASTNode* target = node->children[0];
+                ArrayInfo* array = expect_array(target->children[0]->data.name);
+                IROperand index = construct_ir(target->children[1]);
+                IROperand right = construct_ir(node->children[1]);
+                expect_integer(index, "an array index");
+                expect_integer(right, "an array element");
+                int idx = emit_instr(IR_ASTORE, -1, index, right);
+                block->instrs[idx].name = array->name;
+                return no_operand();
+            }
+            char* name = node->children[0]->data.name;
+            expect_scalar(name);
+            if (lowering_loop && !inline_depth) {
+                if (!strcmp(name, lowering_loop->data.name)) {
+                    printf("Loop variable %s cannot be assigned!\n", name);
+                    exit(1);
+                }
+                int k = find_reduction(lowering_loop, name);
+                if (k >= 0) {
+                    IROperand value = construct_ir(node->children[1]);
+                    expect_integer(value, "a reduction value");
+                    int idx = emit_instr(IR_REDUCE, -1, value, const_operand(k));
+                    block->instrs[idx].name = (char*)reduce_names[lowering_loop->children[2]->children[k]->data.value];
+                    return no_operand();
+                }
+            }
+            IROperand right = construct_ir(node->children[1]);
+            bool is_string = is_string_var(name);
+            if (is_string_operand(right) != is_string) {
+                printf("Type mismatch in assignment to %s!\n", name);
+                exit(1);
+            }
+            int dst = new_value(inline_depth ? NULL : name);
+            values[dst].is_string = is_string;
+            emit_instr(IR_COPY, dst, right, no_operand());
+            write_var(name, dst);
+            return no_operand();
+        }
+        case NODE_BINARY_OP: {
+            IROperand lhs = construct_ir(node->children[0]);
+            IROperand rhs = construct_ir(node->children[1]);
+            if (node->data.op == CAT && (!is_string_operand(lhs) || !is_string_operand(rhs))) {
+                printf("& needs STRING operands!\n");
+                exit(1);
+            }
+            if (node->data.op != CAT) {
+                expect_integer(lhs, "a number");
+                expect_integer(rhs, "a number");
+            }
+            int dst = new_value(NULL);
+            values[dst].is_string = node->data.op == CAT;
+            int idx = emit_instr(IR_BINOP, dst, lhs, rhs);
+            block->instrs[idx].bin_op = node->data.op;
+            return value_operand(dst);
+        }
+        case NODE_IDENTIFIER:
+            expect_scalar(node->data.name);
+            if (lowering_loop && !inline_depth && find_reduction(lowering_loop, node->data.name) >= 0) {
+                printf("Reduction variable %s cannot be read inside PARALLEL FOR!\n", node->data.name);
+                exit(1);
+            }
+            return value_operand(read_var(node->data.name));
+        case NODE_NUMBER:
+            return const_operand(node->data.value);
+        case NODE_LITERAL:
+            return string_operand(node->data.name);
+        case NODE_FUNCTION:
+        case NODE_PROCEDURE:
+            register_function(node);
+            return no_operand();
+        case NODE_CALL:
+        case NODE_CALL_STMT:
+            return lower_call(node);
+        case NODE_CHECKPOINT:
+            emit_instr(IR_CHECKPOINT, -1, no_operand(), no_operand());
+            return no_operand();
+        case NODE_PARALLEL_FOR:
+            return lower_parallel_for(node);
+        case NODE_RETURN: {
+            IROperand value = construct_ir(node->children[0]);
+            expect_integer(value, "a return value");
+            emit_instr(IR_RETURN, -1, value, no_operand());
+            return no_operand();
+        }
+        default:
+            printf("Error Generating IR!: Unrecognized Token Node");
+            exit(1);
+    }
+}
+
+// Optimization passes
+//=======================
+int live_instr_count(void) {
+    int n = 0;
+    for (int i = 0; i < block->count; i++) {
+        if (!block->instrs[i].dead) { n++; }
+    }
+    return n;
+}
+
+void kill_instr(int idx) {
+    IRInstr* in = &block->instrs[idx];
+    if (in->dead) { return; }
+    in->dead = true;
+    for (int a = 0; a < operand_count(in); a++) {
+        IROperand* o = operand_at(in, a);
+        if (o->kind == OPND_VALUE) { values[o->value].live_uses--; }
+    }
+}
+
+// Rewrite every live use of `value` to `with`, following the def-use chain.
+void replace_uses(int value, IROperand with) {
+    SSAValue* v = &values[value];
+    int count = v->use_count;
+    for (int i = 0; i < count; i++) {
+        int instr = v->uses[i].instr, slot = v->uses[i].slot;
+        IRInstr* in = &block->instrs[instr];
+        IROperand* o = operand_at(in, slot);
+        if (in->dead || o->kind != OPND_VALUE || o->value != value) { continue; }
+        *o = with;
+        if (with.kind == OPND_VALUE) { add_use(with.value, instr, slot); }
+    }
+    v->live_uses = 0;
+}
+
+// t = a op b; x = t  ->  x = a op b
+// x = y           ->  uses of x read y directly
+void copy_propagation(void) {
+    for (int i = 0; i < block->count; i++) {
+        IRInstr* in = &block->instrs[i];
+        if (in->dead || in->op != IR_COPY) { continue; }
+        IROperand src = in->args[0];
+        int dst = in->dst;
+        if (src.kind == OPND_VALUE && values[src.value].var == NULL
+            && values[src.value].live_uses == 1 && values[src.value].def >= 0) {
+            int def = values[src.value].def;
+            kill_instr(i);
+            block->instrs[def].dst = dst;
+            values[dst].def = def;
+            continue;
+        }
+        kill_instr(i);
+        replace_uses(dst, src);
+    }
+}
+
+bool fold_binop(OpType op, int a, int b, int* result) {
+    unsigned int ua = (unsigned int)a, ub = (unsigned int)b;
+    switch (op) {
+        case ADD: *result = (int)(ua + ub); return true;
+        case SUB: *result = (int)(ua - ub); return true;
+        case MUL: *result = (int)(ua * ub); return true;
+        case DIV:
+            if (b == 0 || (a == -2147483647 - 1 && b == -1)) { return false; }
+            *result = a / b;
+            return true;
+        default: return false;
+    }
+}
+
+bool same_operand(IROperand a, IROperand b) {
+    return a.kind == b.kind && a.value == b.value;
+}
+
+// Folded literals stay short enough for one bytecode line
+#define STRING_FOLD_MAX 200
+
+// Local value numbering over the single block: fold constant expressions and
+// reuse the first instruction computing an identical expression.
+void global_value_numbering(void) {
+    int table_size = 16;
+    while (table_size < block->count * 2) { table_size *= 2; }
+    int* table = malloc(sizeof(int) * table_size);
+    for (int i = 0; i < table_size; i++) { table[i] = -1; }
+
+    for (int i = 0; i < block->count; i++) {
+        IRInstr* in = &block->instrs[i];
+        if (in->dead || in->op != IR_BINOP) { continue; }
+        IROperand a = in->args[0], b = in->args[1];
+        int folded;
+        if (a.kind == OPND_STRING && b.kind == OPND_STRING
+            && strlen(string_consts[a.value]) + strlen(string_consts[b.value]) <= STRING_FOLD_MAX) {
+            char* left = string_consts[a.value];
+            char* right = string_consts[b.value];
+            char* joined = malloc(strlen(left) + strlen(right) + 1);
+            strcpy(joined, left);
+            strcat(joined, right);
+            kill_instr(i);
+            replace_uses(in->dst, string_operand(joined));
+            free(joined);
+            continue;
+        }
+        if (a.kind == OPND_CONST && b.kind == OPND_CONST && fold_binop(in->bin_op, a.value, b.value, &folded)) {
+            kill_instr(i);
+            replace_uses(in->dst, const_operand(folded));
+            continue;
+        }
+        if ((in->bin_op == ADD || in->bin_op == MUL)
+            && ((a.kind == OPND_CONST && b.kind == OPND_VALUE) || (a.kind == b.kind && a.value > b.value))) {
+            in->args[0] = b;
+            in->args[1] = a;
+            a = in->args[0];
+            b = in->args[1];
+        }
+        unsigned int h = (unsigned int)in->bin_op * 31u;
+        h = (h + (unsigned int)a.kind) * 31u + (unsigned int)a.value;
+        h = (h + (unsigned int)b.kind) * 31u + (unsigned int)b.value;
+        int slot = (int)(h & (unsigned int)(table_size - 1));
+        while (table[slot] != -1) {
+            IRInstr* prev = &block->instrs[table[slot]];
+            if (prev->bin_op == in->bin_op && same_operand(prev->args[0], a) && same_operand(prev->args[1], b)) {
+                break;
+            }
+            slot = (slot + 1) & (table_size - 1);
+        }
+        if (table[slot] == -1) {
+            table[slot] = i;
+            continue;
+        }
+        kill_instr(i);
+        replace_uses(in->dst, value_operand(block->instrs[table[slot]].dst));
+    }
+    free(table);
+}
+
+// Interval of every value, assuming nothing about a variable's entry value.
+// Array accesses whose index interval lies inside the bounds lose their check.
+void operand_range(IROperand o, long long* lo, long long* hi) {
+    if (o.kind == OPND_CONST) {
+        *lo = *hi = o.value;
+    } else if (o.kind == OPND_STRING) {
+        *lo = -2147483647LL - 1;
+        *hi = 2147483647LL;
+    } else {
+        *lo = values[o.value].lo;
+        *hi = values[o.value].hi;
+    }
+}
+
+void range_analysis(void) {
+    const long long int_min = -2147483647LL - 1, int_max = 2147483647LL;
+    for (int i = 0; i < block->count; i++) {
+        IRInstr* in = &block->instrs[i];
+        if (in->dead) { continue; }
+        long long alo, ahi, blo, bhi;
+        if (in->op == IR_COPY) {
+            operand_range(in->args[0], &values[in->dst].lo, &values[in->dst].hi);
+        } else if (in->op == IR_BINOP) {
+            operand_range(in->args[0], &alo, &ahi);
+            operand_range(in->args[1], &blo, &bhi);
+            long long c[4];
+            bool known = true;
+            switch (in->bin_op) {
+                case ADD: c[0] = alo + blo; c[1] = ahi + bhi; c[2] = c[0]; c[3] = c[1]; break;
+                case SUB: c[0] = alo - bhi; c[1] = ahi - blo; c[2] = c[0]; c[3] = c[1]; break;
+                case MUL: c[0] = alo * blo; c[1] = alo * bhi; c[2] = ahi * blo; c[3] = ahi * bhi; break;
+                case DIV:
+                    // only divisors of one sign, and never INT_MIN / -1
+                    known = (blo > 0 || bhi < 0) && !(alo == int_min && blo <= -1 && bhi >= -1);
+                    if (known) { c[0] = alo / blo; c[1] = alo / bhi; c[2] = ahi / blo; c[3] = ahi / bhi; }
+                    break;
+                default: known = false; break;
+            }
+            if (!known) { continue; }
+            long long lo = c[0], hi = c[0];
+            for (int k = 1; k < 4; k++) {
+                if (c[k] < lo) { lo = c[k]; }
+                if (c[k] > hi) { hi = c[k]; }
+            }
+            // a result that may wrap tells us nothing
+            if (lo >= int_min && hi <= int_max) {
+                values[in->dst].lo = lo;
+                values[in->dst].hi = hi;
+            }
+        } else if (in->op == IR_ALOAD || in->op == IR_ASTORE) {
+            ArrayInfo* array = find_array(in->name);
+            operand_range(in->args[0], &alo, &ahi);
+            if (alo == ahi && (alo < array->lower || alo > array->upper)) {
+                printf("Array index %lld out of range for %s[%d:%d]!\n", alo, in->name, array->lower, array->upper);
+                exit(1);
+            }
+            if (alo >= array->lower && ahi <= array->upper) {
+                in->checked = false;
+            }
+        }
+    }
+}
+
+// Remove definitions whose values never reach an output. Array loads that
+// may still fail their bounds check and calls are kept.
+void dead_store_elimination(void) {
+    for (int i = block->count - 1; i >= 0; i--) {
+        IRInstr* in = &block->instrs[i];
+        if (in->dead || in->dst < 0 || (in->op == IR_ALOAD && in->checked) || in->op == IR_CALL) { continue; }
+        if (values[in->dst].live_uses == 0) { kill_instr(i); }
+    }
+}
+
+void run_block_passes(void) {
+    fprintf(stderr, "[opt] %-10s: %d instrs\n", "lower", live_instr_count());
+    copy_propagation();
+    fprintf(stderr, "[opt] %-10s: %d instrs\n", "copy-prop", live_instr_count());
+    if (opt_level >= 2) {
+        global_value_numbering();
+        fprintf(stderr, "[opt] %-10s: %d instrs\n", "gvn", live_instr_count());
+    }
+    range_analysis();
+    dead_store_elimination();
+    fprintf(stderr, "[opt] %-10s: %d instrs\n", "dse", live_instr_count());
+}
+
+void run_passes(void) {
+    if (opt_level <= 0) { return; }
+    for (int f = 0; f < function_count; f++) {
+        if (functions[f].inlinable) { continue; }
+        const char* kind = functions[f].kernel ? "kernel" : functions[f].returns ? "function" : "procedure";
+        fprintf(stderr, "[opt] %s %s\n", kind, functions[f].name);
+        block = &functions[f].block;
+        run_block_passes();
+    }
+    block = &main_block;
+    run_block_passes();
+}
+
+// IR Emission
+//=======================
+// Leaves SSA: a value is written to its variable's slot unless the value
+// currently held there is still needed later, in which case it gets a temp.
+char** value_names = NULL;
+
+typedef struct {
+    char* var;
+    int value;
+} HomeSlot;
+
+HomeSlot* homes = NULL;
+int home_count = 0;
+
+int* home_of(char* var) {
+    for (int i = 0; i < home_count; i++) {
+        if (!strcmp(homes[i].var, var)) { return &homes[i].value; }
+    }
+    homes = realloc(homes, sizeof(HomeSlot) * (home_count + 1));
+    homes[home_count].var = var;
+    homes[home_count].value = -1;
+    return &homes[home_count++].value;
+}
+
+char* temp_names = NULL;
+
+// Names live in temp_names, one 16-byte entry per instruction.
+char* temp_name(int instr, int temp) {
+    char* buf = temp_names + 16 * instr;
+    sprintf(buf, "t%d", temp);
+    return buf;
+}
+
+char* operand_name(IROperand o) {
+    static char buf[2][300];
+    static int which = 0;
+    if (o.kind == OPND_STRING) {
+        which ^= 1;
+        snprintf(buf[which], sizeof(buf[which]), "\"%s\"", string_consts[o.value]);
+        return buf[which];
+    }
+    if (o.kind == OPND_VALUE) {
+        int v = o.value;
+        if (!value_names[v]) {
+            // entry value of a variable, still sitting in its slot
+            value_names[v] = values[v].var;
+        }
+        return value_names[v];
+    }
+    which ^= 1;
+    sprintf(buf[which], "%d", o.value);
+    return buf[which];
+}
+
+void emit_ir(FILE* ir_file) {
+    int* last_use = malloc(sizeof(int) * (value_count ? value_count : 1));
+    value_names = calloc(value_count ? value_count : 1, sizeof(char*));
+    temp_names = malloc(16 * (block->count ? block->count : 1));
+    home_count = 0;
+    for (int v = 0; v < value_count; v++) {
+        last_use[v] = -1;
+    }
+    for (int i = 0; i < block->count; i++) {
+        IRInstr* in = &block->instrs[i];
+        if (in->dead) { continue; }
+        for (int a = 0; a < operand_count(in); a++) {
+            IROperand* o = operand_at(in, a);
+            if (o->kind == OPND_VALUE) { last_use[o->value] = i; }
+        }
+    }
+    // entry values read by this block start out in their home slots
+    for (int v = 0; v < value_count; v++) {
+        if (values[v].var && values[v].def < 0 && last_use[v] >= 0) { *home_of(values[v].var) = v; }
+    }
+
+    for (int i = 0; i < block->count; i++) {
+        IRInstr* in = &block->instrs[i];
+        if (in->dead) { continue; }
+        char* dst = NULL;
+        if (in->dst >= 0) {
+            SSAValue* v = &values[in->dst];
+            if (v->var) {
+                int* home = home_of(v->var);
+                if (*home >= 0 && *home != in->dst && last_use[*home] > i) {
+                    dst = temp_name(i, tempVars++);
+                } else {
+                    dst = v->var;
+                    *home = in->dst;
+                }
+            } else {
+                dst = temp_name(i, v->temp);
+            }
+        }
+        switch (in->op) {
+            case IR_DECL:
+                fprintf(ir_file, "%s\n", in->name);
+                break;
+            case IR_OUTPUT:
+                fprintf(ir_file, "%s %s\n", is_string_operand(in->args[0]) ? "outputs" : "output",
+                        operand_name(in->args[0]));
+                break;
+            case IR_COPY:
+                fprintf(ir_file, "%s = %s\n", dst, operand_name(in->args[0]));
+                break;
+            case IR_BINOP: {
+                char* lhs = operand_name(in->args[0]);
+                fprintf(ir_file, "%s = %s %s %s\n", dst, lhs, opname(in->bin_op), operand_name(in->args[1]));
+                break;
+            }
+            case IR_ARRAY_DECL:
+                fprintf(ir_file, "array %s %d %d\n", in->name, in->args[0].value, in->args[1].value);
+                break;
+            case IR_ALOAD:
+                fprintf(ir_file, "%s = %s [ %s ]%s\n", dst, in->name, operand_name(in->args[0]),
+                        in->checked ? "" : " unchecked");
+                break;
+            case IR_ASTORE: {
+                char* index = operand_name(in->args[0]);
+                fprintf(ir_file, "%s [ %s ] = %s%s\n", in->name, index, operand_name(in->args[1]),
+                        in->checked ? "" : " unchecked");
+                break;
+            }
+            case IR_CALL:
+                if (dst) { fprintf(ir_file, "%s = ", dst); }
+                fprintf(ir_file, "call %s", in->name);
+                for (int a = 0; a < in->call_argc; a++) {
+                    fprintf(ir_file, " %s", operand_name(in->call_args[a]));
+                }
+                fprintf(ir_file, "\n");
+                break;
+            case IR_RETURN:
+                fprintf(ir_file, "return %s\n", operand_name(in->args[0]));
+                break;
+            case IR_CHECKPOINT:
+                fprintf(ir_file, "checkpoint\n");
+                break;
+            case IR_PFOR:
+                fprintf(ir_file, "pfor %s %s", in->name, operand_name(in->args[0]));
+                fprintf(ir_file, " %s", operand_name(in->args[1]));
+                for (int a = 0; a < in->call_argc; a++) {
+                    fprintf(ir_file, " %s", operand_name(in->call_args[a]));
+                }
+                fprintf(ir_file, "\n");
+                break;
+            case IR_REDUCE:
+                fprintf(ir_file, "reduce %s %d %s\n", in->name, in->args[1].value, operand_name(in->args[0]));
+                break;
+            case IR_MERGE:
+                fprintf(ir_file, "%s = merge %d %s\n", dst, in->args[1].value, operand_name(in->args[0]));
+                break;
+        }
+        if (in->dst >= 0) { value_names[in->dst] = dst; }
+    }
+    free(last_use);
+    free(value_names);
+    free(temp_names);
+    value_names = NULL;
+    temp_names = NULL;
+}
+
+void free_block(BasicBlock* b) {
+    for (int i = 0; i < b->count; i++) {
+        free(b->instrs[i].call_args);
+    }
+    b->count = 0;
+}
+
+// Each subroutine lowered out of line becomes a section
+//   function name param...      (or procedure)
+//   ...
+//   endfunction                 (or endprocedure)
+// written once, after the array declarations it may use. A PARALLEL FOR
+// body is a "kernel name reductions param..." section.
+void emit_functions(FILE* ir_file) {
+    for (int f = 0; f < function_count; f++) {
+        FunctionInfo* fn = &functions[f];
+        if (fn->inlinable || fn->emitted) { continue; }
+        const char* kind = fn->kernel ? "kernel" : fn->returns ? "function" : "procedure";
+        fprintf(ir_file, "%s %s", kind, fn->name);
+        if (fn->kernel) { fprintf(ir_file, " %d", fn->reduction_count); }
+        for (int i = 0; i < fn->param_count; i++) {
+            fprintf(ir_file, " %s", fn->params[i]);
+        }
+        fprintf(ir_file, "\n");
+        block = &fn->block;
+        emit_ir(ir_file);
+        free_block(block);
+        free(block->instrs);
+        block->instrs = NULL;
+        block->capacity = 0;
+        block = &main_block;
+        fprintf(ir_file, "end%s\n", kind);
+        fn->emitted = true;
+    }
+}
+
+// Drops the emitted IR so the next statement starts from empty tables.
+void reset_ir(void) {
+    for (int v = 0; v < value_count; v++) {
+        free(values[v].uses);
+    }
+    value_count = 0;
+    free_block(block);
+    var_def_count = 0;
+    home_count = 0;
+    tempVars = 0;
+}
+
+
+// Statements between a FUNCTION/PROCEDURE header and its END line are
+// collected into the definition, and those between PARALLEL FOR and NEXT
+// into the loop. Returns the next complete top-level statement, or NULL
+// while a definition or loop is still open.
+ASTNode* open_function = NULL;
+ASTNode* open_loop = NULL;
+
+ASTNode* collect_statement(ASTNode* stmt) {
+    if (stmt->type == NODE_PARALLEL_FOR) {
+        if (open_function || open_loop) {
+            printf("PARALLEL FOR must be outside subroutines and other loops!\n");
+            exit(1);
+        }
+        open_loop = stmt;
+        return NULL;
+    }
+    if (stmt->type == NODE_NEXT) {
+        if (!open_loop || strcmp(stmt->data.name, open_loop->data.name)) {
+            printf("NEXT %s without a matching PARALLEL FOR!\n", stmt->data.name);
+            exit(1);
+        }
+        free_ast(stmt);
+        ASTNode* loop = open_loop;
+        open_loop = NULL;
+        return loop;
+    }
+    if (open_loop) {
+        if (stmt->type != NODE_VAR_DECL && stmt->type != NODE_ASSIGN && stmt->type != NODE_CALL_STMT) {
+            printf("Only declarations, assignments and CALL are allowed in PARALLEL FOR!\n");
+            exit(1);
+        }
+        add_child(open_loop, stmt);
+        return NULL;
+    }
+    if (stmt->type == NODE_FUNCTION || stmt->type == NODE_PROCEDURE) {
+        if (open_function) {
+            printf("Subroutine %s defined inside %s!\n", stmt->data.name, open_function->data.name);
+            exit(1);
+        }
+        open_function = stmt;
+        return NULL;
+    }
+    if (stmt->type == NODE_END_FUNCTION || stmt->type == NODE_END_PROCEDURE) {
+        NodeType expected = stmt->type == NODE_END_FUNCTION ? NODE_FUNCTION : NODE_PROCEDURE;
+        if (!open_function || open_function->type != expected) {
+            printf("%s without a matching header!\n", stmt->type == NODE_END_FUNCTION ? "ENDFUNCTION" : "ENDPROCEDURE");
+            exit(1);
+        }
+        free_ast(stmt);
+        ASTNode* def = open_function;
+        ASTNode* last = def->children[def->child_count - 1];
+        if (expected == NODE_FUNCTION && last->type != NODE_RETURN) {
+            printf("Function %s must end with RETURN!\n", def->data.name);
+            exit(1);
+        }
+        open_function = NULL;
+        return def;
+    }
+    if (stmt->type == NODE_RETURN) {
+        // without control flow a RETURN can only be the last statement
+        if (!open_function || open_function->type != NODE_FUNCTION) {
+            printf("RETURN outside of a FUNCTION!\n");
+            exit(1);
+        }
+        ASTNode* last = open_function->children[open_function->child_count - 1];
+        if (last->type == NODE_RETURN) {
+            printf("Function %s returns twice!\n", open_function->data.name);
+            exit(1);
+        }
+    }
+    if (!open_function) { return stmt; }
+    ASTNode* last = open_function->children[open_function->child_count - 1];
+    if (last->type == NODE_RETURN) {
+        printf("Statement after RETURN in %s!\n", open_function->data.name);
+        exit(1);
+    }
+    if (stmt->type == NODE_ARRAY_DECL) {
+        printf("Arrays must be declared outside subroutines!\n");
+        exit(1);
+    }
+    if (stmt->type == NODE_CHECKPOINT) {
+        printf("CHECKPOINT must be outside subroutines!\n");
+        exit(1);
+    }
+    add_child(open_function, stmt);
+    return NULL;
+}
+
+int main(int argc, char* argv[]) {
+    bool stream = false;
+    bool stats_json = false;
+    char* paths[2] = {NULL, NULL};
+    int path_count = 0;
+    bool bad_level = false;
+    for (int i = 1; i < argc; i++) {
+        if (!strncmp(argv[i], "-O", 2)) {
+            // exactly -O0, -O1 or -O2; atoi would take -Ofoo as -O0
+            if (strlen(argv[i]) != 3 || argv[i][2] < '0' || argv[i][2] > '2') {
+                printf("Unknown optimization level: %s\n", argv[i]);
+                bad_level = true;
+            } else {
+                opt_level = argv[i][2] - '0';
+            }
+        } else if (!strcmp(argv[i], "--stream")) {
+            stream = true;
+        } else if (statsFlag(argv[i], &stats_json)) {
+            continue;
+        } else if (path_count < 2) {
+            paths[path_count++] = argv[i];
+        }
+    }
+    if (bad_level || path_count < 2) {
+        printf("Usage: %s [-O0|-O1|-O2] [--stream] [--stats[=json]] <source.pseu> <output.pseuir|->\n", argv[0]);
+        return 1;
+    }
+    if (stream && opt_level > 0) {
+        // the passes need to see every later use of a value
+        printf("--stream only supports -O0\n");
+        return 1;
+    }
+
+    char str[256];
+    long long statement_count = 0;
+    FILE* file = fopen(paths[0], "r");
+    if (!file) {
+        perror("fopen");
+        return 1;
+    }
+    FILE* ir_file = strcmp(paths[1], "-") ? fopen(paths[1], "w") : stdout;
+    if (!ir_file) {
+        perror("fopen");
+        return 1;
+    }
+
+    if (stream) {
+        // Each statement is lowered, written and freed before the next line
+        // is read, so memory stays flat however long the program is.
+        static char sink[1 << 16];
+        setvbuf(ir_file, sink, _IOFBF, sizeof(sink));
+        statsEnter("read");
+        while (fgets(str, sizeof(str), file)) {
+            ASTNode* stmt = parse_statement(str);
+            if (stmt) { stmt = collect_statement(stmt); }
+            if (stmt) {
+                statement_count++;
+                statsEnter("lower");
+                construct_ir(stmt);
+                statsEnter("emit");
+                emit_functions(ir_file);
+                emit_ir(ir_file);
+                reset_ir();
+                free_ast(stmt);
+            }
+            statsEnter("read");
+        }
+        if (open_function) {
+            printf("Missing END for %s!\n", open_function->data.name);
+            return 1;
+        }
+        if (open_loop) {
+            printf("Missing NEXT for %s!\n", open_loop->data.name);
+            return 1;
+        }
+    } else {
+        ASTNode* program = new_node(NODE_PROGRAM);
+
+        statsEnter("read");
+        while (fgets(str, sizeof(str), file)) {
+            ASTNode* stmt = parse_statement(str);
+            if (stmt) { stmt = collect_statement(stmt); }
+            if (stmt) {
+                statement_count++;
+                add_child(program, stmt);
+            }
+            statsEnter("read");
+        }
+        if (open_function) {
+            printf("Missing END for %s!\n", open_function->data.name);
+            return 1;
+        }
+        if (open_loop) {
+            printf("Missing NEXT for %s!\n", open_loop->data.name);
+            return 1;
+        }
+
+        statsEnter("lower");
+        construct_ir(program);
+        statsEnter("optimize");
+        run_passes();
+        statsEnter("emit");
+        emit_ir(ir_file);
+        emit_functions(ir_file);
+        //print_ast(program, 0);
+    }
+
+    if (ir_file != stdout) fclose(ir_file);
     fclose(file);
-    //print_ast(program, 0);
+    statsNote("statements", statement_count);
+    statsReport("irgen", stats_json);
     return 0;
-}
\ No newline at end of file
+}
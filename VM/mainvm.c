@@ -4,94 +4,1312 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <time.h>
 
-#define STACK_SIZE 1024
-#define MEM_SIZE 512
-#define LINE_SIZE 128
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <unistd.h>
+#endif
 
-// Stack
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+
+#include "../Common/bytecode.h"
+#include "../Common/stats.h"
+
+#define STACK_SIZE BC_STACK_SIZE
+#define MEM_SIZE BC_DEFAULT_MEM_SIZE
+#define CALL_DEPTH BC_CALL_DEPTH
+#define LOCALS_SIZE BC_LOCALS_SIZE
+#define LINE_SIZE 512
+#define BATCH_ROWS 1024
+#define CSV_LINE_SIZE 4096
+#define MAX_THREADS 64
+#define MAX_REDUCTIONS BC_MAX_REDUCTIONS
+#define LOOP_CHUNK 64       // iterations a worker claims at a time
+
+// Program
+const Instr* program = NULL;
+int program_len = 0;
+
+// Subroutines, in the order their FUNC directives appear
+const BcFunction* funcs = NULL;
+int func_count = 0;
+
+// Slot names from the "; [idx] name" comments BCGen writes
+char* slot_names[MEM_SIZE];
+
+// Stack: entries below the top; the top itself is cached in run()
 int stack[STACK_SIZE];
-int sp = -1;
+int max_depth = 0;
+
+// Memory: MEM_SIZE slots unless the program asks for more, 64-byte aligned
+// so array storage starts on a cache line
+int* mem = NULL;
+int mem_size = MEM_SIZE;
+
+// Frames: locals of all active calls sit back to back in one array, and
+// each call saves only its return address and the caller's frame base, so a
+// call never allocates.
+typedef struct Frame {
+    const Instr* ret;
+    int* locals;
+} Frame;
 
-// Memory
-int mem[MEM_SIZE];
+Frame frames[CALL_DEPTH];
+int frame_locals[LOCALS_SIZE];
+int max_frame_depth = 0;    // deepest operand stack use of any subroutine
 
-// Push value onto stack
-void push(int val) {
-    if (sp >= STACK_SIZE - 1) {
-        printf("Stack overflow!\n");
+// Platform locks for the PARALLEL FOR thread pool
+#ifdef _WIN32
+typedef CRITICAL_SECTION Lock;
+typedef CONDITION_VARIABLE Cond;
+void lockInit(Lock* l) { InitializeCriticalSection(l); }
+void lockAcquire(Lock* l) { EnterCriticalSection(l); }
+void lockRelease(Lock* l) { LeaveCriticalSection(l); }
+void condInit(Cond* c) { InitializeConditionVariable(c); }
+void condWait(Cond* c, Lock* l) { SleepConditionVariableCS(c, l, INFINITE); }
+void condBroadcast(Cond* c) { WakeAllConditionVariable(c); }
+#else
+typedef pthread_mutex_t Lock;
+typedef pthread_cond_t Cond;
+void lockInit(Lock* l) { pthread_mutex_init(l, NULL); }
+void lockAcquire(Lock* l) { pthread_mutex_lock(l); }
+void lockRelease(Lock* l) { pthread_mutex_unlock(l); }
+void condInit(Cond* c) { pthread_cond_init(c, NULL); }
+void condWait(Cond* c, Lock* l) { pthread_cond_wait(c, l); }
+void condBroadcast(Cond* c) { pthread_cond_broadcast(c); }
+#endif
+
+// What one interpreter needs of its own: the main code runs on the globals
+// above, each PARALLEL FOR worker on private copies. Arrays stay shared in
+// mem; IRGen only lets an iteration write its own elements.
+typedef struct VmThread {
+    int* stack;
+    Frame* frames;
+    int* locals;
+    int acc[MAX_REDUCTIONS];        // this worker's partial reductions
+    Lock lock;                      // guards lo and hi
+    long long lo, hi;               // iterations not yet claimed
+    long long steals;
+    int id;
+} VmThread;
+
+VmThread main_thread = { .stack = stack, .frames = frames, .locals = frame_locals };
+
+// String heap: the constant pool from the bytecode (mapped in place for
+// binary files) and a bump arena for strings built at run time. Arena
+// records are never freed; handles are offsets, so the arena may move.
+const char* str_pool = NULL;
+uint32_t str_pool_size = 0;
+char* text_pool = NULL;         // pool assembled from CONST lines
+char* arena = NULL;
+uint32_t arena_used = 0;
+uint32_t arena_capacity = 0;
+long long arena_strings = 0;
+long long inline_strings = 0;
+bool arena_mapped = false;      // restored from a snapshot; grow by copying
+
+// Where run() starts: 0 normally, just after the SNAP when restoring
+int start_pc = 0;
+int start_tos = 0;
+int start_depth = 0;
+int* depth_at = NULL;       // static stack depth before each pc, kept to restore
+
+// Snapshot: --snapshot writes one at the first SNAP, keeping a copy of the
+// output written before it so a restored run can replay it
+const char* snapshot_path = NULL;
+char* out_log = NULL;
+size_t out_log_size = 0;
+size_t out_log_capacity = 0;
+double run_start = 0;
+
+// OUT goes to stdout unless a batch run collects it into columns
+int** out_columns = NULL;
+int out_row = 0;
+int out_next = 0;
+
+char* trim(char* str) {
+    while(*str == ' ' || *str == '\t') str++;
+    char* end = str + strlen(str) - 1;
+    while(end > str && (*end==' ' || *end=='\t' || *end=='\n')) *end-- = '\0';
+    return str;
+}
+
+void* alignedAlloc(size_t bytes, size_t align) {
+    bytes = (bytes + align - 1) / align * align;
+#ifdef _WIN32
+    void* p = _aligned_malloc(bytes, align);
+#else
+    void* p = aligned_alloc(align, bytes);
+#endif
+    if (!p) {
+        printf("Out of memory!\n");
         exit(1);
     }
-    stack[++sp] = val;
+    memset(p, 0, bytes);
+    return p;
+}
+
+double now_seconds(void) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
 }
 
-// Pop value from stack
-int pop() {
-    if (sp < 0) {
-        printf("Stack underflow!\n");
+Instr* loaded = NULL;
+int loaded_capacity = 0;
+
+void poolConst(int32_t handle, const char* text) {
+    uint32_t offset = (uint32_t)handle >> 2;
+    int32_t len = (int32_t)strlen(text);
+    if ((handle & 3) != BC_STR_POOL) {
+        printf("Error: Bad string constant handle %d\n", handle);
         exit(1);
     }
-    return stack[sp--];
+    if (offset + bcRecordSize(len) > str_pool_size) {
+        text_pool = realloc(text_pool, offset + bcRecordSize(len));
+        memset(text_pool + str_pool_size, 0, offset + bcRecordSize(len) - str_pool_size);
+        str_pool_size = offset + bcRecordSize(len);
+    }
+    memcpy(text_pool + offset, &len, 4);
+    memcpy(text_pool + offset + 4, text, len);
+    str_pool = text_pool;
 }
-char* trim(char* str) {
-    while(*str == ' ' || *str == '\t') str++;
-    char* end = str + strlen(str) - 1;
-    while(end > str && (*end==' ' || *end=='\t' || *end=='\n')) *end-- = '\0';
-    return str;
+
+// Called by concatStrings; a restored arena lives in the snapshot mapping,
+// so it is copied out rather than reallocated
+void growArena(uint32_t needed) {
+    while (needed > arena_capacity) {
+        arena_capacity = arena_capacity ? arena_capacity * 2 : 64 * 1024;
+    }
+    if (arena_mapped) {
+        char* grown = malloc(arena_capacity);
+        if (grown) memcpy(grown, arena, arena_used);
+        arena = grown;
+        arena_mapped = false;
+    } else {
+        arena = realloc(arena, arena_capacity);
+    }
+    if (!arena) {
+        printf("Out of memory!\n");
+        exit(1);
+    }
 }
 
-int main(int argc, char* argv[]) {
-    FILE *fp = fopen(argv[1], "r");
+BC_STRING_RUNTIME(BC_AS_CODE)
+
+void logOutput(const char* bytes, size_t len) {
+    if (out_log_size + len > out_log_capacity) {
+        while (out_log_size + len > out_log_capacity) {
+            out_log_capacity = out_log_capacity ? out_log_capacity * 2 : 4096;
+        }
+        out_log = realloc(out_log, out_log_capacity);
+        if (!out_log) {
+            printf("Out of memory!\n");
+            exit(1);
+        }
+    }
+    memcpy(out_log + out_log_size, bytes, len);
+    out_log_size += len;
+}
+
+void outputString(int32_t h) {
+    char buf[BC_STR_INLINE_MAX];
+    int len;
+    const char* bytes = stringBytes(h, &len, buf);
+    fwrite(bytes, 1, len, stdout);
+    putchar('\n');
+    if (snapshot_path) {
+        logOutput(bytes, len);
+        logOutput("\n", 1);
+    }
+}
+
+void emitInstr(OpCode op, int arg) {
+    if (program_len == loaded_capacity) {
+        loaded_capacity = loaded_capacity ? loaded_capacity * 2 : 256;
+        loaded = realloc(loaded, sizeof(Instr) * loaded_capacity);
+    }
+    loaded[program_len].op = op;
+    loaded[program_len].arg = arg;
+    program_len++;
+}
+
+void nameSlot(int slot, const char* name, int len) {
+    if (slot < 0 || slot >= MEM_SIZE) return;
+    free(slot_names[slot]);
+    slot_names[slot] = malloc(len + 1);
+    memcpy(slot_names[slot], name, len);
+    slot_names[slot][len] = '\0';
+}
+
+// Decode the text bytecode once so neither execution mode re-parses lines
+void loadText(FILE* fp) {
+    char line[LINE_SIZE];
+    BcFunction* text_funcs = NULL;
+    char** func_names = NULL;
+    int* call_pcs = NULL;
+    char** callees = NULL;
+    int call_count = 0;
+
+    while (fgets(line, sizeof(line), fp)) {
+        Instr in;
+        int slot;
+        char* name;
+        BcFunction fn;
+        int kind = bcDecodeLine(line, &in, &slot, &name, &fn);
+        if (kind < 0) {
+            printf("Unknown instruction: %s\n", bcTrim(line));
+            exit(1);
+        }
+        if (slot >= 0) nameSlot(slot, name, (int)strlen(name));
+        if (kind == 2 && in.arg > mem_size) mem_size = in.arg;
+        if (kind == 4) poolConst(in.arg, name);
+        if (kind == 3) {
+            fn.pc = program_len;
+            text_funcs = realloc(text_funcs, sizeof(BcFunction) * (func_count + 1));
+            func_names = realloc(func_names, sizeof(char*) * (func_count + 1));
+            text_funcs[func_count] = fn;
+            func_names[func_count++] = _strdup(name);
+        }
+        if (kind != 1) continue;
+        if (in.op == OP_CALL || in.op == OP_PFOR) {
+            // resolved once every FUNC and KERNEL has been seen
+            call_pcs = realloc(call_pcs, sizeof(int) * (call_count + 1));
+            callees = realloc(callees, sizeof(char*) * (call_count + 1));
+            call_pcs[call_count] = program_len;
+            callees[call_count++] = _strdup(name);
+        }
+        emitInstr(in.op, in.arg);
+    }
+    bool has_end = false;
+    for (int pc = 0; pc < program_len && !has_end; pc++) has_end = loaded[pc].op == OP_END;
+    if (!has_end) emitInstr(OP_END, 0);
+    for (int c = 0; c < call_count; c++) {
+        int f = 0;
+        while (f < func_count && strcmp(func_names[f], callees[c])) f++;
+        if (f == func_count) {
+            printf("Error: Call to undefined subroutine %s\n", callees[c]);
+            exit(1);
+        }
+        loaded[call_pcs[c]].arg = text_funcs[f].pc;
+        free(callees[c]);
+    }
+    for (int f = 0; f < func_count; f++) free(func_names[f]);
+    free(func_names);
+    free(callees);
+    free(call_pcs);
+    funcs = text_funcs;
+    program = loaded;
+}
+
+void loadNames(const char* names, uint32_t size) {
+    uint32_t pos = 0;
+    while (pos + 8 <= size) {
+        int32_t slot, len;
+        memcpy(&slot, names + pos, 4);
+        memcpy(&len, names + pos + 4, 4);
+        pos += 8;
+        if (len < 0 || pos + len > size) break;
+        nameSlot(slot, names + pos, len);
+        pos += len;
+    }
+}
+
+bool checkHeader(const BytecodeHeader* header, long long file_size) {
+    return memcmp(header->magic, BC_MAGIC, BC_MAGIC_LEN) == 0
+        && header->instr_offset % BC_PAGE_SIZE == 0
+        && header->instr_count > 0
+        && header->instr_offset + (long long)header->instr_count * (long long)sizeof(Instr) <= file_size
+        && header->names_offset + (long long)header->names_size <= file_size
+        && header->funcs_offset + (long long)header->funcs_count * (long long)sizeof(BcFunction) <= file_size
+        && header->pool_offset % 4 == 0
+        && header->pool_offset + (long long)header->pool_size <= file_size;
+}
+
+// Binary bytecode read into a heap buffer
+void loadBinaryRead(FILE* fp) {
+    fseek(fp, 0, SEEK_END);
+    long long size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    BytecodeHeader header;
+    if (fread(&header, sizeof(header), 1, fp) != 1 || !checkHeader(&header, size)) {
+        printf("Error: Malformed bytecode file\n");
+        exit(1);
+    }
+    loaded = malloc(sizeof(Instr) * header.instr_count);
+    fseek(fp, header.instr_offset, SEEK_SET);
+    if (fread(loaded, sizeof(Instr), header.instr_count, fp) != header.instr_count) {
+        printf("Error: Truncated bytecode file\n");
+        exit(1);
+    }
+    char* names = malloc(header.names_size + 1);
+    fseek(fp, header.names_offset, SEEK_SET);
+    if (fread(names, 1, header.names_size, fp) == header.names_size) {
+        loadNames(names, header.names_size);
+    }
+    free(names);
+    BcFunction* read_funcs = malloc(sizeof(BcFunction) * (header.funcs_count + 1));
+    fseek(fp, header.funcs_offset, SEEK_SET);
+    if (fread(read_funcs, sizeof(BcFunction), header.funcs_count, fp) != header.funcs_count) {
+        printf("Error: Truncated bytecode file\n");
+        exit(1);
+    }
+    funcs = read_funcs;
+    func_count = header.funcs_count;
+    text_pool = malloc(header.pool_size + 1);
+    fseek(fp, header.pool_offset, SEEK_SET);
+    if (fread(text_pool, 1, header.pool_size, fp) != header.pool_size) {
+        printf("Error: Truncated bytecode file\n");
+        exit(1);
+    }
+    str_pool = text_pool;
+    str_pool_size = header.pool_size;
+    program = loaded;
+    program_len = header.instr_count;
+    if ((int)header.mem_size > mem_size) mem_size = header.mem_size;
+}
+
+// Maps a whole file, read-only and shared, or copy-on-write so the pages
+// can be modified without touching the file. Returns NULL on failure.
+char* mapFile(const char* path, bool writable, long long* size) {
+#ifdef _WIN32
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) return NULL;
+    LARGE_INTEGER file_size;
+    GetFileSizeEx(file, &file_size);
+    *size = file_size.QuadPart;
+    HANDLE mapping = CreateFileMappingA(file, NULL, writable ? PAGE_WRITECOPY : PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(file);
+    if (!mapping) return NULL;
+    char* base = MapViewOfFile(mapping, writable ? FILE_MAP_COPY : FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(mapping);
+    return base;
+#else
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return NULL;
+    }
+    *size = st.st_size;
+    void* map = mmap(NULL, st.st_size, writable ? PROT_READ | PROT_WRITE : PROT_READ,
+                     writable ? MAP_PRIVATE : MAP_SHARED, fd, 0);
+    close(fd);
+    return map == MAP_FAILED ? NULL : map;
+#endif
+}
+
+// Binary bytecode mapped read-only and executed in place; processes running
+// the same file share its pages.
+bool loadBinaryMapped(const char* path) {
+    long long size;
+    const char* base = mapFile(path, false, &size);
+    if (!base) return false;
+    const BytecodeHeader* header = (const BytecodeHeader*)base;
+    if (size < (long long)sizeof(BytecodeHeader) || !checkHeader(header, size)) {
+        printf("Error: Malformed bytecode file\n");
+        exit(1);
+    }
+    program = (const Instr*)(base + header->instr_offset);
+    program_len = header->instr_count;
+    if ((int)header->mem_size > mem_size) mem_size = header->mem_size;
+    loadNames(base + header->names_offset, header->names_size);
+    // variable-length name records leave the table unaligned; copy it out
+    BcFunction* mapped_funcs = malloc(sizeof(BcFunction) * (header->funcs_count + 1));
+    memcpy(mapped_funcs, base + header->funcs_offset, sizeof(BcFunction) * header->funcs_count);
+    funcs = mapped_funcs;
+    func_count = header->funcs_count;
+    // constants are read straight from the mapping
+    str_pool = base + header->pool_offset;
+    str_pool_size = header->pool_size;
+    return true;
+}
+
+// Validation
+//=======================
+// Reduction op of each kernel accumulator, from bcCheckProgram
+OpCode (*reduce_ops)[MAX_REDUCTIONS] = NULL;
+
+void validateProgram(void) {
+    BcCheck check = { .program = program, .program_len = program_len, .funcs = funcs, .func_count = func_count,
+                      .mem_size = mem_size, .depth_at = depth_at };
+    bcCheckProgram(&check);
+    reduce_ops = check.reduce_ops;
+    max_depth = check.max_depth;
+    max_frame_depth = check.max_frame_depth;
+}
+
+// Snapshot
+//=======================
+// A snapshot is the header page, then mem on a page boundary so a restore
+// can map it copy-on-write and use it as mem directly, then the stack, the
+// string arena and the output written before the SNAP. The code up to and
+// including the SNAP and the subroutines it can reach are hashed, since they
+// produced the saved state; the code after it may change between the run
+// that wrote the snapshot and the one that restores it.
+#define SNAP_MAGIC "PSEUSN\x02"
+
+typedef struct SnapshotHeader {
+    char magic[BC_MAGIC_LEN];
+    uint32_t code_hash;         // see codeHash
+    uint32_t pc;                // first instruction after the SNAP
+    int32_t tos;
+    uint32_t depth;             // stack entries below tos
+    uint32_t mem_size;
+    uint32_t mem_offset;        // multiple of BC_PAGE_SIZE
+    uint32_t stack_offset;
+    uint32_t arena_offset;
+    uint32_t arena_size;
+    uint32_t output_offset;
+    uint32_t output_size;
+} SnapshotHeader;
+
+// FNV-1a
+uint32_t hashBytes(uint32_t h, const void* data, size_t len) {
+    const unsigned char* p = data;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ p[i]) * 16777619u;
+    }
+    return h;
+}
+
+// Hashes [from, to), giving each subroutine called there the next number in
+// order the first time it is reached and queueing it.
+uint32_t hashRegion(uint32_t h, int from, int to, int* order, int* queue, int* reached) {
+    for (int pc = from; pc < to; pc++) {
+        Instr in = program[pc];
+        if (in.op == OP_CALL || in.op == OP_PFOR) {
+            int f = (int)(bcFunctionAt(funcs, func_count, in.arg) - funcs);
+            if (order[f] < 0) {
+                order[f] = *reached;
+                queue[(*reached)++] = f;
+            }
+            in.arg = order[f];
+        }
+        h = hashBytes(h, &in, sizeof(in));
+    }
+    return h;
+}
+
+// Hash of the code before pc, every subroutine it can reach with its table
+// entry, the string pool and mem_size. Call targets are hashed by the order
+// they are reached rather than by pc, so the subroutines may move when the
+// code after the SNAP changes length.
+uint32_t codeHash(int pc) {
+    int* order = malloc(sizeof(int) * (func_count + 1));
+    int* queue = malloc(sizeof(int) * (func_count + 1));
+    for (int f = 0; f < func_count; f++) order[f] = -1;
+    int reached = 0;
+    uint32_t h = hashRegion(2166136261u, 0, pc, order, queue, &reached);
+    for (int q = 0; q < reached; q++) {
+        int f = queue[q];
+        int entry[3] = { funcs[f].nargs, funcs[f].returns, funcs[f].reductions };
+        h = hashBytes(h, entry, sizeof(entry));
+        h = hashRegion(h, funcs[f].pc, f + 1 < func_count ? funcs[f + 1].pc : program_len, order, queue, &reached);
+    }
+    free(order);
+    free(queue);
+    h = hashBytes(h, str_pool, str_pool_size);
+    return hashBytes(h, &mem_size, sizeof(mem_size));
+}
+
+void writePadding(FILE* fp, long long from, long long to) {
+    static const char zeros[BC_PAGE_SIZE];
+    fwrite(zeros, 1, to - from, fp);
+}
+
+void writeSnapshot(int pc, int tos, int depth) {
+    double prefix_time = now_seconds() - run_start;
+    long long mem_bytes = (long long)sizeof(int) * mem_size;
+    long long stack_offset = BC_PAGE_SIZE + mem_bytes;
+    long long arena_offset = stack_offset + (long long)sizeof(int) * depth;
+    long long output_offset = arena_offset + arena_used;
+    if (output_offset + (long long)out_log_size > 0xffffffffLL) {
+        printf("Snapshot too large!\n");
+        exit(1);
+    }
+    SnapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAP_MAGIC, BC_MAGIC_LEN);
+    header.code_hash = codeHash(pc);
+    header.pc = pc;
+    header.tos = tos;
+    header.depth = depth;
+    header.mem_size = mem_size;
+    header.mem_offset = BC_PAGE_SIZE;
+    header.stack_offset = (uint32_t)stack_offset;
+    header.arena_offset = (uint32_t)arena_offset;
+    header.arena_size = arena_used;
+    header.output_offset = (uint32_t)output_offset;
+    header.output_size = (uint32_t)out_log_size;
+
+    FILE* fp = fopen(snapshot_path, "wb");
     if (!fp) {
-        printf("Error: Cannot open output.pseubc\n");
+        printf("Error: Cannot create %s\n", snapshot_path);
+        exit(1);
+    }
+    fwrite(&header, sizeof(header), 1, fp);
+    writePadding(fp, sizeof(header), BC_PAGE_SIZE);
+    fwrite(mem, sizeof(int), mem_size, fp);
+    fwrite(stack, sizeof(int), depth, fp);
+    fwrite(arena, 1, arena_used, fp);
+    fwrite(out_log, 1, out_log_size, fp);
+    if (ferror(fp) || fclose(fp) != 0) {
+        printf("Error: Cannot write %s\n", snapshot_path);
+        exit(1);
+    }
+    fprintf(stderr, "[snapshot] wrote %s at pc %d: prefix ran in %.6f s\n", snapshot_path, pc, prefix_time);
+    fflush(stdout);
+    free(out_log);
+    out_log = NULL;
+    out_log_size = out_log_capacity = 0;
+    snapshot_path = NULL;
+}
+
+// Maps the snapshot over mem and the arena and sets run() to resume after
+// the SNAP. Must come after validateProgram, with depth_at allocated, instead
+// of allocating mem.
+void restoreSnapshot(const char* path) {
+    double start = now_seconds();
+    long long size;
+    char* base = mapFile(path, true, &size);
+    if (!base) {
+        printf("Error: Cannot open %s\n", path);
+        exit(1);
+    }
+    const SnapshotHeader* header = (const SnapshotHeader*)base;
+    if (size < BC_PAGE_SIZE || memcmp(header->magic, SNAP_MAGIC, BC_MAGIC_LEN) != 0
+        || header->mem_offset % BC_PAGE_SIZE != 0 || header->depth > STACK_SIZE
+        || header->mem_offset + (long long)sizeof(int) * header->mem_size > header->stack_offset
+        || header->stack_offset + (long long)sizeof(int) * header->depth > header->arena_offset
+        || (long long)header->arena_offset + header->arena_size > header->output_offset
+        || (long long)header->output_offset + header->output_size > size
+        || header->arena_offset % 4 != 0 || header->arena_size % 4 != 0) {
+        printf("Error: Malformed snapshot file\n");
+        exit(1);
+    }
+    if (header->mem_size != (uint32_t)mem_size || header->pc == 0 || header->pc >= (uint32_t)program_len
+        || program[header->pc - 1].op != OP_SNAP || header->depth != (uint32_t)depth_at[header->pc]
+        || header->code_hash != codeHash(header->pc)) {
+        printf("Error: Snapshot does not match this program\n");
+        exit(1);
+    }
+    mem = (int*)(base + header->mem_offset);
+    memcpy(stack, base + header->stack_offset, sizeof(int) * header->depth);
+    arena = base + header->arena_offset;
+    arena_used = arena_capacity = header->arena_size;
+    arena_mapped = true;
+    fwrite(base + header->output_offset, 1, header->output_size, stdout);
+    start_pc = header->pc;
+    start_tos = header->tos;
+    start_depth = header->depth;
+    fprintf(stderr, "[snapshot] restored %s at pc %u in %.6f s\n", path, header->pc, now_seconds() - start);
+}
+
+// Parallel Loops
+//=======================
+// PFOR splits first..last evenly over the workers. Each claims LOOP_CHUNK
+// iterations at a time from the front of its range and, once that is empty,
+// steals the upper half of another worker's remainder. Worker 0 is the
+// thread that ran PFOR; the others are started on the first loop that needs
+// them and sleep between loops. Reductions are wrapping sums, mins and maxes,
+// so folding the workers' partial results gives the same value however the
+// iterations were split.
+void run(VmThread* t, const Instr* start, int tos, int depth);
+
+int thread_count = 0;               // --threads; 0 until main picks the CPU count
+VmThread* workers[MAX_THREADS];
+int pool_size = 0;                  // workers allocated, including worker 0
+int loop_threads = 0;               // workers taking part in the current loop
+int loop_generation = 0;
+int loop_finished = 0;
+Lock pool_lock;
+Cond pool_start;
+Cond pool_done;
+
+Instr loop_stub[2];                 // CALL kernel; END
+int loop_nargs = 0;
+int loop_args[STACK_SIZE];          // first, last, shared arguments
+const OpCode* loop_ops = NULL;      // reduction ops of the last PFOR
+int loop_result[MAX_REDUCTIONS];
+long long loops_run = 0;
+
+int cpuCount(void) {
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return (int)info.dwNumberOfProcessors;
+#else
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+#endif
+}
+
+int reduceIdentity(OpCode op) {
+    return op == OP_RMIN ? INT32_MAX : op == OP_RMAX ? INT32_MIN : 0;
+}
+
+int reduceValue(OpCode op, int a, int b) {
+    switch (op) {
+        case OP_RSUM: return (int)((unsigned int)a + (unsigned int)b);
+        case OP_RMIN: return a < b ? a : b;
+        case OP_RMAX: return a > b ? a : b;
+        default: return a;      // reduction never folded
+    }
+}
+
+// One kernel call for iteration i on t's private stack; stack[0] is the
+// dummy under the first argument, as in run().
+void runIteration(VmThread* t, int i) {
+    t->stack[1] = i;
+    memcpy(t->stack + 2, loop_args + 2, sizeof(int) * (loop_nargs - 1));
+    run(t, loop_stub, t->stack[loop_nargs], loop_nargs);
+}
+
+bool claimChunk(VmThread* t, long long* first, long long* last) {
+    lockAcquire(&t->lock);
+    bool found = t->lo <= t->hi;
+    if (found) {
+        *first = t->lo;
+        *last = t->hi - t->lo < LOOP_CHUNK ? t->hi : t->lo + LOOP_CHUNK - 1;
+        t->lo = *last + 1;
+    }
+    lockRelease(&t->lock);
+    return found;
+}
+
+// Takes the upper half of the first non-empty range after t's own
+bool stealChunk(VmThread* t) {
+    for (int n = 1; n < loop_threads; n++) {
+        VmThread* victim = workers[(t->id + n) % loop_threads];
+        lockAcquire(&victim->lock);
+        long long left = victim->hi - victim->lo + 1;
+        long long lo = victim->hi - (left + 1) / 2 + 1;
+        long long hi = victim->hi;
+        if (left > 0) victim->hi = lo - 1;
+        lockRelease(&victim->lock);
+        if (left > 0) {
+            lockAcquire(&t->lock);
+            t->lo = lo;
+            t->hi = hi;
+            lockRelease(&t->lock);
+            t->steals++;
+            return true;
+        }
+    }
+    return false;
+}
+
+void workLoop(VmThread* t) {
+    long long first, last;
+    while (claimChunk(t, &first, &last) || (stealChunk(t) && claimChunk(t, &first, &last))) {
+        for (long long i = first; i <= last; i++) runIteration(t, (int)i);
+    }
+}
+
+#ifdef _WIN32
+DWORD WINAPI workerMain(LPVOID arg) {
+#else
+void* workerMain(void* arg) {
+#endif
+    VmThread* t = arg;
+    int seen = 0;
+    for (;;) {
+        lockAcquire(&pool_lock);
+        while (loop_generation == seen) condWait(&pool_start, &pool_lock);
+        seen = loop_generation;
+        bool active = t->id < loop_threads;
+        lockRelease(&pool_lock);
+        if (!active) continue;
+        workLoop(t);
+        lockAcquire(&pool_lock);
+        if (++loop_finished == loop_threads - 1) condBroadcast(&pool_done);
+        lockRelease(&pool_lock);
+    }
+    return 0;
+}
+
+VmThread* newWorker(int id) {
+    VmThread* t = malloc(sizeof(VmThread));
+    memset(t, 0, sizeof(VmThread));
+    t->stack = malloc(sizeof(int) * STACK_SIZE);
+    t->frames = malloc(sizeof(Frame) * CALL_DEPTH);
+    t->locals = malloc(sizeof(int) * LOCALS_SIZE);
+    t->id = id;
+    lockInit(&t->lock);
+    if (id == 0) return t;
+#ifdef _WIN32
+    HANDLE handle = CreateThread(NULL, 0, workerMain, t, 0, NULL);
+    if (!handle) {
+#else
+    pthread_t handle;
+    if (pthread_create(&handle, NULL, workerMain, t) != 0) {
+#endif
+        printf("Error: Cannot start a worker thread\n");
+        exit(1);
+    }
+    return t;
+}
+
+// Runs kernel for loop_args[0]..loop_args[1] and sets loop_result
+void parallelFor(const BcFunction* kernel) {
+    long long first = loop_args[0];
+    long long last = loop_args[1];
+    long long count = last >= first ? last - first + 1 : 0;
+    loop_ops = reduce_ops[kernel - funcs];
+    loop_stub[0].op = OP_CALL;
+    loop_stub[0].arg = kernel->pc;
+    loop_stub[1].op = OP_END;
+    loop_nargs = kernel->nargs;
+    loops_run++;
+
+    // a worker gets at least one chunk
+    long long wanted = (count + LOOP_CHUNK - 1) / LOOP_CHUNK;
+    int threads = wanted < thread_count ? (int)wanted : thread_count;
+    if (threads < 1) threads = 1;
+    if (pool_size == 0) {
+        lockInit(&pool_lock);
+        condInit(&pool_start);
+        condInit(&pool_done);
+    }
+    while (pool_size < threads) {
+        workers[pool_size] = newWorker(pool_size);
+        pool_size++;
+    }
+    for (int w = 0; w < threads; w++) {
+        VmThread* t = workers[w];
+        for (int k = 0; k < kernel->reductions; k++) t->acc[k] = reduceIdentity(loop_ops[k]);
+        t->lo = first + count * w / threads;
+        t->hi = first + count * (w + 1) / threads - 1;
+    }
+    if (threads > 1) {
+        lockAcquire(&pool_lock);
+        loop_threads = threads;
+        loop_finished = 0;
+        loop_generation++;
+        condBroadcast(&pool_start);
+        lockRelease(&pool_lock);
+    } else {
+        loop_threads = 1;
+    }
+    workLoop(workers[0]);
+    if (threads > 1) {
+        lockAcquire(&pool_lock);
+        while (loop_finished < threads - 1) condWait(&pool_done, &pool_lock);
+        lockRelease(&pool_lock);
+    }
+    // in worker order, though any order gives the same result
+    for (int k = 0; k < kernel->reductions; k++) {
+        loop_result[k] = workers[0]->acc[k];
+        for (int w = 1; w < threads; w++) loop_result[k] = reduceValue(loop_ops[k], loop_result[k], workers[w]->acc[k]);
+    }
+}
+
+// Interpreter
+//=======================
+// The top of stack is kept in `tos` and only spilled to the stack array when
+// something is pushed over it. `below` points one past the entry under the
+// top; at depth 0 tos is a dummy that the first push spills to stack[0].
+// t supplies the stack, frames and reduction accumulators.
+#define BINARY_OP(expr) { int b = tos; int a = *--below; tos = (expr); break; }
+
+void run(VmThread* t, const Instr* start, int tos, int depth) {
+    int* stack_base = t->stack;
+    int* below = stack_base + depth;
+    int* locals = t->locals;            // current frame
+    int* locals_top = t->locals;        // first free local
+    Frame* frame = t->frames;           // next free frame
+    for (const Instr* ip = start; ; ip++) {
+        switch (ip->op) {
+            case OP_PUSH: *below++ = tos; tos = ip->arg; break;
+            case OP_LOAD: *below++ = tos; tos = mem[ip->arg]; break;
+            case OP_STORE: mem[ip->arg] = tos; tos = *--below; break;
+            // through unsigned so overflow wraps, as in constant folding,
+            // the batch kernels and AOT, instead of being undefined
+            case OP_ADD: BINARY_OP((int)((unsigned int)a + (unsigned int)b))
+            case OP_SUB: BINARY_OP((int)((unsigned int)a - (unsigned int)b))
+            case OP_MUL: BINARY_OP((int)((unsigned int)a * (unsigned int)b))
+            case OP_DIV: BINARY_OP(bcDivide(a, b))
+            // high 32 bits of the 64-bit product
+            case OP_MULHI: BINARY_OP((int)(((long long)a * b) >> 32))
+            // counts are taken mod 32, as x86 does, so none is undefined
+            case OP_SHL: BINARY_OP((int)((unsigned int)a << (b & 31)))
+            case OP_SHR: BINARY_OP((int)((unsigned int)a >> (b & 31)))    // logical
+            case OP_SAR: BINARY_OP(a >> (b & 31))                         // arithmetic
+            // indices are zero-based; BOUND precedes them unless IRGen
+            // proved the index in range
+            case OP_LOADX: tos = mem[ip->arg + tos]; break;
+            case OP_STOREX: {
+                int idx = tos;
+                mem[ip->arg + idx] = *--below;
+                tos = *--below;
+                break;
+            }
+            case OP_BOUND:
+                if ((unsigned int)tos >= (unsigned int)ip->arg) {
+                    printf("Array index out of range!\n");
+                    exit(1);
+                }
+                break;
+            case OP_OUT: {
+                int val = tos;
+                tos = *--below;
+                if (out_columns) {
+                    out_columns[out_next++][out_row] = val;
+                } else {
+                    printf("%d\n", val);
+                    if (snapshot_path) {
+                        char text[16];
+                        logOutput(text, sprintf(text, "%d\n", val));
+                    }
+                }
+                break;
+            }
+            // recursion depth is only known at run time, so a call checks
+            // that the deepest subroutine still fits on both stacks
+            case OP_CALL:
+                if (frame == t->frames + CALL_DEPTH || below + max_frame_depth >= stack_base + STACK_SIZE) {
+                    printf("Call stack overflow!\n");
+                    exit(1);
+                }
+                frame->ret = ip;
+                frame->locals = locals;
+                frame++;
+                ip = program + ip->arg - 1;
+                break;
+            case OP_ENTER:
+                if (ip->arg > t->locals + LOCALS_SIZE - locals_top) {
+                    printf("Call stack overflow!\n");
+                    exit(1);
+                }
+                locals = locals_top;
+                locals_top += ip->arg;
+                memset(locals, 0, sizeof(int) * ip->arg);
+                break;
+            case OP_RET:
+                locals_top = locals;
+                frame--;
+                locals = frame->locals;
+                ip = frame->ret;
+                break;
+            case OP_LOADL: *below++ = tos; tos = locals[ip->arg]; break;
+            case OP_STOREL: locals[ip->arg] = tos; tos = *--below; break;
+            case OP_CONCAT: BINARY_OP(concatStrings(a, b))
+            case OP_OUTS: outputString(tos); tos = *--below; break;
+            // only at depth 0 of the call stack, so there are no frames to save
+            case OP_SNAP:
+                if (snapshot_path) writeSnapshot((int)(ip - program) + 1, tos, (int)(below - stack_base));
+                break;
+            // only in the main code; validateProgram checked the kernel
+            case OP_PFOR: {
+                const BcFunction* kernel = bcFunctionAt(funcs, func_count, ip->arg);
+                int n = kernel->nargs + 1;
+                loop_args[n - 1] = tos;
+                below -= n - 1;
+                memcpy(loop_args, below, sizeof(int) * (n - 1));
+                tos = *--below;
+                parallelFor(kernel);
+                break;
+            }
+            case OP_RSUM: t->acc[ip->arg] = reduceValue(OP_RSUM, t->acc[ip->arg], tos); tos = *--below; break;
+            case OP_RMIN: t->acc[ip->arg] = reduceValue(OP_RMIN, t->acc[ip->arg], tos); tos = *--below; break;
+            case OP_RMAX: t->acc[ip->arg] = reduceValue(OP_RMAX, t->acc[ip->arg], tos); tos = *--below; break;
+            case OP_MERGE: tos = reduceValue(loop_ops[ip->arg], tos, loop_result[ip->arg]); break;
+            case OP_END: return;
+        }
+    }
+}
+
+// Batch Evaluation
+//=======================
+// Every mem slot and stack entry is a column of BATCH_ROWS values, so each
+// instruction is dispatched once per batch instead of once per row.
+int* batch_mem[MEM_SIZE];
+int** batch_stack = NULL;
+int batch_depth = 0;
+int batch_slots = 0;
+int out_count = 0;
+
+int* newColumn(void) {
+    // 32-byte aligned so the AVX2 kernels can use aligned loads
+    return alignedAlloc(sizeof(int) * BATCH_ROWS, 32);
+}
+
+// Slots touched and OUT count; the stack depth comes from validateProgram.
+void analyzeProgram(void) {
+    batch_depth = max_depth;
+    if (func_count > 0) {
+        printf("Error: subroutines are not supported in batch mode\n");
+        exit(1);
+    }
+    for (int pc = 0; pc < program_len; pc++) {
+        Instr in = program[pc];
+        if (in.op == OP_LOADX || in.op == OP_STOREX || mem_size > MEM_SIZE) {
+            printf("Error: arrays are not supported in batch mode\n");
+            exit(1);
+        }
+        if (in.op == OP_CONCAT || in.op == OP_OUTS) {
+            printf("Error: strings are not supported in batch mode\n");
+            exit(1);
+        }
+        if ((in.op == OP_LOAD || in.op == OP_STORE) && in.arg >= batch_slots) batch_slots = in.arg + 1;
+        if (in.op == OP_OUT) out_count++;
+    }
+}
+
+void kernelAdd(int* a, const int* b, int n) {
+    int i = 0;
+#if defined(__AVX2__)
+    for (; i + 8 <= n; i += 8) {
+        __m256i va = _mm256_load_si256((const __m256i*)(a + i));
+        __m256i vb = _mm256_load_si256((const __m256i*)(b + i));
+        _mm256_store_si256((__m256i*)(a + i), _mm256_add_epi32(va, vb));
+    }
+#elif defined(__SSE2__) || defined(_M_X64)
+    for (; i + 4 <= n; i += 4) {
+        __m128i va = _mm_load_si128((const __m128i*)(a + i));
+        __m128i vb = _mm_load_si128((const __m128i*)(b + i));
+        _mm_store_si128((__m128i*)(a + i), _mm_add_epi32(va, vb));
+    }
+#endif
+    for (; i < n; i++) a[i] = (int)((unsigned int)a[i] + (unsigned int)b[i]);
+}
+
+void kernelSub(int* a, const int* b, int n) {
+    int i = 0;
+#if defined(__AVX2__)
+    for (; i + 8 <= n; i += 8) {
+        __m256i va = _mm256_load_si256((const __m256i*)(a + i));
+        __m256i vb = _mm256_load_si256((const __m256i*)(b + i));
+        _mm256_store_si256((__m256i*)(a + i), _mm256_sub_epi32(va, vb));
+    }
+#elif defined(__SSE2__) || defined(_M_X64)
+    for (; i + 4 <= n; i += 4) {
+        __m128i va = _mm_load_si128((const __m128i*)(a + i));
+        __m128i vb = _mm_load_si128((const __m128i*)(b + i));
+        _mm_store_si128((__m128i*)(a + i), _mm_sub_epi32(va, vb));
+    }
+#endif
+    for (; i < n; i++) a[i] = (int)((unsigned int)a[i] - (unsigned int)b[i]);
+}
+
+void kernelMul(int* a, const int* b, int n) {
+    int i = 0;
+#if defined(__AVX2__)
+    for (; i + 8 <= n; i += 8) {
+        __m256i va = _mm256_load_si256((const __m256i*)(a + i));
+        __m256i vb = _mm256_load_si256((const __m256i*)(b + i));
+        _mm256_store_si256((__m256i*)(a + i), _mm256_mullo_epi32(va, vb));
+    }
+#endif
+    // SSE2 has no 32-bit low multiply; leave the rest to the compiler
+    for (; i < n; i++) a[i] = (int)((unsigned int)a[i] * (unsigned int)b[i]);
+}
+
+// No SIMD integer divide exists; a scalar loop keeps C truncation and traps.
+void kernelDiv(int* a, const int* b, int n) {
+    for (int i = 0; i < n; i++) a[i] = bcDivide(a[i], b[i]);
+}
+
+void kernelMulHi(int* a, const int* b, int n) {
+    for (int i = 0; i < n; i++) a[i] = (int)(((long long)a[i] * b[i]) >> 32);
+}
+
+void kernelShift(OpCode op, int* a, const int* b, int n) {
+    for (int i = 0; i < n; i++) {
+        if (op == OP_SHL) a[i] = (int)((unsigned int)a[i] << (b[i] & 31));
+        else if (op == OP_SHR) a[i] = (int)((unsigned int)a[i] >> (b[i] & 31));
+        else a[i] = a[i] >> (b[i] & 31);
+    }
+}
+
+// Runs the program over rows [0, n) of the current batch columns.
+void runBatch(int n, int** outputs) {
+    int bsp = -1;
+    int out = 0;
+    for (int pc = 0; ; pc++) {
+        Instr in = program[pc];
+        switch (in.op) {
+            case OP_PUSH: {
+                int* col = batch_stack[++bsp];
+                for (int i = 0; i < n; i++) col[i] = in.arg;
+                break;
+            }
+            case OP_LOAD:
+                memcpy(batch_stack[++bsp], batch_mem[in.arg], sizeof(int) * n);
+                break;
+            case OP_STORE: {
+                // swap buffers instead of copying the column back
+                int* col = batch_mem[in.arg];
+                batch_mem[in.arg] = batch_stack[bsp];
+                batch_stack[bsp--] = col;
+                break;
+            }
+            case OP_ADD: bsp--; kernelAdd(batch_stack[bsp], batch_stack[bsp + 1], n); break;
+            case OP_SUB: bsp--; kernelSub(batch_stack[bsp], batch_stack[bsp + 1], n); break;
+            case OP_MUL: bsp--; kernelMul(batch_stack[bsp], batch_stack[bsp + 1], n); break;
+            case OP_DIV: bsp--; kernelDiv(batch_stack[bsp], batch_stack[bsp + 1], n); break;
+            case OP_MULHI: bsp--; kernelMulHi(batch_stack[bsp], batch_stack[bsp + 1], n); break;
+            case OP_SHL:
+            case OP_SHR:
+            case OP_SAR: bsp--; kernelShift(in.op, batch_stack[bsp], batch_stack[bsp + 1], n); break;
+            case OP_OUT: {
+                int* col = outputs[out];
+                outputs[out++] = batch_stack[bsp];
+                batch_stack[bsp--] = col;
+                break;
+            }
+            case OP_LOADX:
+            case OP_STOREX:
+            case OP_BOUND:
+            case OP_CALL:
+            case OP_RET:
+            case OP_ENTER:
+            case OP_LOADL:
+            case OP_STOREL:
+            case OP_CONCAT:
+            case OP_OUTS: break;    // rejected by analyzeProgram
+            // rows never resume, so batch mode writes no snapshot (main
+            // clears snapshot_path) and a CHECKPOINT runs straight through
+            case OP_SNAP: break;
+            case OP_PFOR:
+            case OP_RSUM:
+            case OP_RMIN:
+            case OP_RMAX:
+            case OP_MERGE: break;   // need subroutines, rejected by analyzeProgram
+            case OP_END: return;
+        }
+    }
+}
+
+// Same rows through the scalar interpreter, for comparison with runBatch.
+void runRowwise(int n, int** inputs, int* input_slots, int input_count, int** outputs) {
+    out_columns = outputs;
+    for (int r = 0; r < n; r++) {
+        memset(mem, 0, sizeof(int) * batch_slots);
+        for (int c = 0; c < input_count; c++) mem[input_slots[c]] = inputs[c][r];
+        out_row = r;
+        out_next = 0;
+        run(&main_thread, program, 0, 0);
+    }
+    out_columns = NULL;
+}
+
+int splitCsv(char* line, char** fields, int max_fields) {
+    int count = 0;
+    char* field = strtok(line, ",\r\n");
+    while (field && count < max_fields) {
+        fields[count++] = trim(field);
+        field = strtok(NULL, ",\r\n");
+    }
+    return count;
+}
+
+int batchMain(char* in_path, char* out_path, bool rowwise) {
+    analyzeProgram();
+    FILE* in = fopen(in_path, "r");
+    if (!in) {
+        printf("Error: Cannot open %s\n", in_path);
+        return 1;
+    }
+    FILE* out = fopen(out_path, "w");
+    if (!out) {
+        printf("Error: Cannot open %s\n", out_path);
         return 1;
     }
 
-    char line[LINE_SIZE];
+    char line[CSV_LINE_SIZE];
+    char* fields[MEM_SIZE];
+    int input_slots[MEM_SIZE];
+    if (!fgets(line, sizeof(line), in)) {
+        printf("Error: %s has no header\n", in_path);
+        return 1;
+    }
+    int input_count = splitCsv(line, fields, MEM_SIZE);
+    for (int c = 0; c < input_count; c++) {
+        input_slots[c] = -1;
+        for (int s = 0; s < MEM_SIZE; s++) {
+            if (slot_names[s] && !strcmp(slot_names[s], fields[c])) input_slots[c] = s;
+        }
+        if (input_slots[c] < 0) {
+            printf("Error: column %s is not a program variable\n", fields[c]);
+            return 1;
+        }
+    }
 
+    batch_stack = malloc(sizeof(int*) * (batch_depth + 1));
+    for (int i = 0; i <= batch_depth; i++) batch_stack[i] = newColumn();
+    for (int c = 0; c < input_count; c++) {
+        if (input_slots[c] >= batch_slots) batch_slots = input_slots[c] + 1;
+    }
+    for (int s = 0; s < batch_slots; s++) batch_mem[s] = newColumn();
+    int* inputs[MEM_SIZE];
+    for (int c = 0; c < input_count; c++) inputs[c] = newColumn();
+    int** outputs = malloc(sizeof(int*) * (out_count + 1));
+    for (int o = 0; o < out_count; o++) outputs[o] = newColumn();
 
-    while (fgets(line, sizeof(line), fp)) {
-        char lineCopy[LINE_SIZE];
-        strcpy(lineCopy, line);
-        char* instr = trim(strtok(lineCopy, " "));
-
-        if (instr[0] == '\0' || instr[0] == ';') continue; // skip empty lines/comments
-
-        if (strcmp(instr, "PUSH") == 0) {
-            char* arg = trim(strtok(NULL, " "));
-            if (arg[0] == '#') { // literal
-                push(atoi(arg + 1));
-            } else if (arg[0] == '[') { // memory reference
-                int idx = atoi(arg + 1);
-                push(mem[idx]);
+    for (int o = 0; o < out_count; o++) fprintf(out, o ? ",out%d" : "out%d", o);
+    fprintf(out, "\n");
+
+    long long rows = 0;
+    double elapsed = 0;
+    bool done = false;
+    while (!done) {
+        int n = 0;
+        while (n < BATCH_ROWS) {
+            if (!fgets(line, sizeof(line), in)) {
+                done = true;
+                break;
+            }
+            int count = splitCsv(line, fields, MEM_SIZE);
+            if (count == 0) continue;
+            if (count != input_count) {
+                printf("Error: row %lld has %d columns, expected %d\n", rows + n + 1, count, input_count);
+                return 1;
             }
-        } else if (strcmp(instr, "STORE") == 0) {
-            char* arg = trim(strtok(NULL, " "));
-            int idx = atoi(arg + 1);
-            mem[idx] = pop();
-        } else if (strcmp(instr, "LOAD") == 0) {
-            char* arg = trim(strtok(NULL, " "));
-            int idx = atoi(arg + 1);
-            push(mem[idx]);
-        } else if (strcmp(instr, "ADD") == 0) {
-            int b = pop();
-            int a = pop();
-            push(a + b);
-        } else if (strcmp(instr, "DIV") == 0) {
-            int b = pop();
-            int a = pop();
-            push(a / b);
-        } else if (strcmp(instr, "OUT") == 0) {
-            int val = pop();
-            printf("%d\n", val);
-        } else if (strcmp(instr, "END") == 0) {
-            break;
+            for (int c = 0; c < input_count; c++) inputs[c][n] = atoi(fields[c]);
+            n++;
+        }
+        if (n == 0) break;
+
+        double start = now_seconds();
+        if (rowwise) {
+            runRowwise(n, inputs, input_slots, input_count, outputs);
         } else {
-            printf("Unknown instruction: %s\n", instr);
-            return 1;
+            for (int s = 0; s < batch_slots; s++) memset(batch_mem[s], 0, sizeof(int) * n);
+            for (int c = 0; c < input_count; c++) memcpy(batch_mem[input_slots[c]], inputs[c], sizeof(int) * n);
+            runBatch(n, outputs);
+        }
+        elapsed += now_seconds() - start;
+        rows += n;
+
+        for (int r = 0; r < n; r++) {
+            for (int o = 0; o < out_count; o++) fprintf(out, o ? ",%d" : "%d", outputs[o][r]);
+            fprintf(out, "\n");
+        }
+    }
+
+    fprintf(stderr, "[batch] %lld rows in %.6f s (%.0f rows/s, %s)\n", rows, elapsed,
+            elapsed > 0 ? rows / elapsed : 0.0, rowwise ? "row-wise" : "vectorized");
+    fclose(in);
+    fclose(out);
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    char* batch_in = NULL;
+    char* batch_out = NULL;
+    char* path = NULL;
+    bool rowwise = false;
+    bool no_mmap = false;
+    bool load_time = false;
+    bool heap_stats = false;
+    bool stats_json = false;
+    char* restore_path = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--batch") && i + 2 < argc) {
+            batch_in = argv[++i];
+            batch_out = argv[++i];
+        } else if (!strcmp(argv[i], "--rowwise")) {
+            rowwise = true;
+        } else if (!strcmp(argv[i], "--no-mmap")) {
+            no_mmap = true;
+        } else if (!strcmp(argv[i], "--load-time")) {
+            load_time = true;
+        } else if (!strcmp(argv[i], "--heap-stats")) {
+            heap_stats = true;
+        } else if (!strcmp(argv[i], "--snapshot") && i + 1 < argc) {
+            snapshot_path = argv[++i];
+        } else if (!strcmp(argv[i], "--restore") && i + 1 < argc) {
+            restore_path = argv[++i];
+        } else if (!strcmp(argv[i], "--threads") && i + 1 < argc) {
+            thread_count = atoi(argv[++i]);
+            if (thread_count < 1 || thread_count > MAX_THREADS) {
+                printf("Error: --threads must be between 1 and %d\n", MAX_THREADS);
+                return 1;
+            }
+        } else if (statsFlag(argv[i], &stats_json)) {
+            continue;
+        } else {
+            path = argv[i];
         }
     }
+    if (thread_count == 0) thread_count = cpuCount() < MAX_THREADS ? cpuCount() : MAX_THREADS;
+    if (!path) {
+        printf("Usage: %s [--batch <input.csv> <output.csv> [--rowwise]] [--no-mmap] [--load-time] [--heap-stats] [--snapshot <file>] [--restore <file>] [--threads <n>] [--stats[=json]] <program.pseubc>\n", argv[0]);
+        return 1;
+    }
 
+    double load_start = now_seconds();
+    statsEnter("load");
+    FILE *fp = fopen(path, "rb");
+    if (!fp) {
+        printf("Error: Cannot open %s\n", path);
+        return 1;
+    }
+    char magic[BC_MAGIC_LEN];
+    bool binary = fread(magic, 1, BC_MAGIC_LEN, fp) == BC_MAGIC_LEN && memcmp(magic, BC_MAGIC, BC_MAGIC_LEN) == 0;
+    const char* load_mode = "text";
+    if (binary && !no_mmap && loadBinaryMapped(path)) {
+        load_mode = "mmap";
+    } else if (binary) {
+        load_mode = "read";
+        loadBinaryRead(fp);
+    } else {
+        fclose(fp);
+        fp = fopen(path, "r");
+        loadText(fp);
+    }
     fclose(fp);
+    statsEnter("validate");
+    if (restore_path) depth_at = malloc(sizeof(int) * program_len);
+    validateProgram();
+    statsNote("program_instrs", program_len);
+    if (load_time) {
+        fprintf(stderr, "[load] %s: %d instrs in %.6f s\n", load_mode, program_len, now_seconds() - load_start);
+    }
+
+    if (batch_in) {
+        snapshot_path = NULL;       // rows never resume from a snapshot
+        mem = alignedAlloc(sizeof(int) * mem_size, 64);
+        statsEnter("batch");
+        int status = batchMain(batch_in, batch_out, rowwise);
+        statsReport("vm", stats_json);
+        return status;
+    }
+    if (restore_path) {
+        statsEnter("restore");
+        restoreSnapshot(restore_path);
+    } else {
+        mem = alignedAlloc(sizeof(int) * mem_size, 64);
+    }
+    statsEnter("execute");
+    run_start = now_seconds();
+    run(&main_thread, program + start_pc, start_tos, start_depth);
+    fflush(stdout);
+    statsNote("arena_bytes", arena_used);
+    if (loops_run) {
+        long long steals = 0;
+        for (int w = 0; w < pool_size; w++) steals += workers[w]->steals;
+        statsNote("parallel_loops", loops_run);
+        statsNote("threads", pool_size);
+        statsNote("steals", steals);
+    }
+    if (heap_stats) {
+        fprintf(stderr, "[heap] pool %u bytes, arena %u of %u bytes in %lld strings, %lld inline results\n",
+                str_pool_size, arena_used, arena_capacity, arena_strings, inline_strings);
+    }
+    statsReport("vm", stats_json);
     return 0;
 }
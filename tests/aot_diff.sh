@@ -0,0 +1,64 @@
+#!/bin/sh
+# Differential test of AOT against the VM: each program is compiled at IRGen
+# and BCGen -O0 and -O2, run by the VM, then compiled by AOT with CFLAGS -O0
+# and -O2, and the outputs and exit codes must match, also for programs that
+# fault, such as divzero.pseu and divmin.pseu.
+#
+#   tests/aot_diff.sh [program.pseu ...]
+#
+# Without arguments it runs tests/programs/*.pseu and IRGen/main.pseu. The
+# tools are built with $CC (default cc) in a temporary directory.
+set -u
+root=$(cd "$(dirname "$0")/.." && pwd)
+cc=${CC:-cc}
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+build() {
+    if ! $cc -std=gnu17 -O2 -o "$work/$1" "$root/$2" $3; then
+        echo "Cannot build $2"
+        exit 1
+    fi
+}
+build irgen IRGen/main.c ""
+build bcgen BCGen/mainbc.c ""
+build vm VM/mainvm.c -pthread
+build aot AOT/mainaot.c ""
+
+if [ $# -eq 0 ]; then
+    set -- "$root"/tests/programs/*.pseu "$root/IRGen/main.pseu"
+fi
+failed=0
+for src in "$@"; do
+    name=$(basename "$src" .pseu)
+    for level in -O0 -O2; do
+        if ! "$work/irgen" $level "$src" "$work/x.ir" > "$work/log" 2>&1 \
+            || ! "$work/bcgen" $level "$work/x.ir" "$work/x.bc" >> "$work/log" 2>&1; then
+            echo "FAIL $name $level: does not compile"
+            cat "$work/log"
+            failed=1
+            continue
+        fi
+        # braces keep the shell's report of a fatal signal out of the log
+        { "$work/vm" "$work/x.bc" > "$work/vm.out"; } 2> /dev/null
+        echo "exit $?" >> "$work/vm.out"
+        for cflags in -O0 -O2; do
+            if ! CFLAGS=$cflags "$work/aot" "$work/x.bc" "$work/x.c" -o "$work/x.exe" > "$work/log" 2>&1; then
+                echo "FAIL $name $level: AOT with CFLAGS=$cflags"
+                cat "$work/log"
+                failed=1
+                continue
+            fi
+            { "$work/x.exe" > "$work/aot.out"; } 2> /dev/null
+            echo "exit $?" >> "$work/aot.out"
+            if diff -u "$work/vm.out" "$work/aot.out" > "$work/diff"; then
+                echo "ok   $name $level CFLAGS=$cflags"
+            else
+                echo "FAIL $name $level CFLAGS=$cflags"
+                cat "$work/diff"
+                failed=1
+            fi
+        done
+    done
+done
+exit $failed
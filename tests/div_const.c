@@ -0,0 +1,150 @@
+// Exhaustive check of BCGen's strength-reduced division: for each divisor
+// the -O2 sequence is generated, decoded, and run through the VM's own
+// batch kernels for every 32-bit dividend, and through the VM's interpreter
+// for a sample of dividends, against C's truncating a / b.
+//
+//   cc -std=gnu17 -O3 -march=native -pthread -o div_const tests/div_const.c && ./div_const
+//
+// Pass divisors on the command line to check others than the default set.
+#define main bcgen_main
+#include "../BCGen/mainbc.c"
+#undef main
+#define main vm_main
+#include "../VM/mainvm.c"
+#undef main
+
+#define SAMPLE_BLOCKS 64
+#define MAX_SEQ 64
+
+static int divisors[] = {
+    2, 3, 5, 6, 7, 10, 16, 25, 641, 1000, 65537, 1 << 30, 2147483647,
+    -2, -3, -7, -8, -10, -1000, -(1 << 30), -2147483647
+};
+
+// Decodes the sequence BCGen emits for [0] / d into a program that outputs
+// it; false if DIV was kept
+static bool divSequence(int d, Instr* seq, int* len) {
+    FILE* fp = tmpfile();
+    char lhs[] = "[0]";
+    char rhs[16];
+    sprintf(rhs, "#%d", d);
+    if (!EchoStrengthReduced(fp, DIV, lhs, rhs)) {
+        fclose(fp);
+        return false;
+    }
+    rewind(fp);
+    char line[64];
+    *len = 0;
+    while (fgets(line, sizeof(line), fp)) {
+        int slot;
+        char* name;
+        BcFunction fn;
+        if (bcDecodeLine(line, &seq[*len], &slot, &name, &fn) != 1 || ++*len == MAX_SEQ - 2) {
+            printf("Bad sequence for %d: %s", d, line);
+            exit(1);
+        }
+    }
+    fclose(fp);
+    seq[(*len)++] = (Instr){ .op = OP_OUT };
+    seq[(*len)++] = (Instr){ .op = OP_END };
+    return true;
+}
+
+// Makes seq the VM's program, as loading and validating it would
+static void loadSequence(Instr* seq, int len) {
+    program = seq;
+    program_len = len;
+    validateProgram();
+    out_count = 0;
+    batch_slots = 0;
+    analyzeProgram();
+    for (int i = 0; i < len; i++) {
+        if (seq[i].op != OP_PUSH && seq[i].op != OP_LOAD && seq[i].op != OP_ADD && seq[i].op != OP_SUB
+            && seq[i].op != OP_MULHI && seq[i].op != OP_SHL && seq[i].op != OP_SHR && seq[i].op != OP_SAR
+            && seq[i].op != OP_OUT && seq[i].op != OP_END) {
+            printf("Unexpected %s in a division sequence\n", opNames[seq[i].op]);
+            exit(1);
+        }
+    }
+}
+
+// Dividends for the interpreter: the edges around 0, +-d and the int range,
+// then a multiplicative hash of the row
+static int sampleDividend(int d, long long row) {
+    long long edges[] = {
+        -2147483647LL - 1, -2147483647LL, -1, 0, 1, 2147483646LL, 2147483647LL,
+        -(long long)d - 1, -(long long)d, -(long long)d + 1, (long long)d - 1, d, (long long)d + 1
+    };
+    long long count = sizeof(edges) / sizeof(edges[0]);
+    if (row < count) return (int)edges[row];
+    return (int)(uint32_t)((uint64_t)row * 2654435761u);
+}
+
+static bool checkDivisor(int d) {
+    Instr seq[MAX_SEQ];
+    int len;
+    if (!divSequence(d, seq, &len)) {
+        printf("%11d: DIV kept\n", d);
+        return true;
+    }
+    loadSequence(seq, len);
+    static int* outputs[1];
+    if (!outputs[0]) outputs[0] = newColumn();
+    long long ad = d < 0 ? -(long long)d : d;
+
+    // every dividend through the batch kernels
+    long long dividend = -2147483647LL - 1;
+    while (dividend <= 2147483647LL) {
+        int* x = batch_mem[0];
+        for (int i = 0; i < BATCH_ROWS; i++) x[i] = (int)(dividend + i);
+        runBatch(BATCH_ROWS, outputs);
+        const int* q = outputs[0];
+        // q is the truncated quotient iff the remainder is smaller than d
+        // and has the sign of the dividend; cheaper than dividing again
+        int bad = 0;
+        for (int i = 0; i < BATCH_ROWS; i++) {
+            long long r = (long long)x[i] - (long long)q[i] * d;
+            long long ar = r < 0 ? -r : r;
+            bad |= ar >= ad || (r < 0 && x[i] > 0) || (r > 0 && x[i] < 0);
+        }
+        for (int i = 0; bad && i < BATCH_ROWS; i++) {
+            if (q[i] != x[i] / d) {
+                printf("%11d: batch %d / %d gives %d, expected %d\n", d, x[i], d, q[i], x[i] / d);
+                return false;
+            }
+        }
+        dividend += BATCH_ROWS;
+    }
+
+    // a sample through the interpreter's dispatch loop
+    static int* inputs[1];
+    int input_slots[1] = { 0 };
+    if (!inputs[0]) inputs[0] = newColumn();
+    for (int block = 0; block < SAMPLE_BLOCKS; block++) {
+        for (int i = 0; i < BATCH_ROWS; i++) inputs[0][i] = sampleDividend(d, (long long)block * BATCH_ROWS + i);
+        runRowwise(BATCH_ROWS, inputs, input_slots, 1, outputs);
+        for (int i = 0; i < BATCH_ROWS; i++) {
+            int x = inputs[0][i];
+            if (outputs[0][i] != x / d) {
+                printf("%11d: interpreter %d / %d gives %d, expected %d\n", d, x, d, outputs[0][i], x / d);
+                return false;
+            }
+        }
+    }
+    printf("%11d: ok (%d instructions)\n", d, len - 2);
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    mem = alignedAlloc(sizeof(int) * mem_size, 64);
+    batch_stack = malloc(sizeof(int*) * MAX_SEQ);
+    for (int i = 0; i < MAX_SEQ; i++) batch_stack[i] = newColumn();
+    batch_mem[0] = newColumn();
+    bool ok = true;
+    if (argc > 1) {
+        for (int i = 1; i < argc; i++) ok &= checkDivisor(atoi(argv[i]));
+    } else {
+        for (size_t i = 0; i < sizeof(divisors) / sizeof(divisors[0]); i++) ok &= checkDivisor(divisors[i]);
+    }
+    return ok ? 0 : 1;
+}
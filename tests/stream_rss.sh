@@ -0,0 +1,80 @@
+#!/bin/sh
+# Peak RSS of streaming compilation against program size: a generated
+# straight-line program of 1 MB, 4 MB, ... up to max_mb (default 1024) is
+# compiled with IRGen --stream piped into BCGen, and the peak RSS that each
+# stage reports with --stats must stay within slack_kb (default 1024) of the
+# smallest program's. Up to 16 MB the non-streaming IRGen is run as well for
+# comparison; it holds the whole AST and grows with the program.
+#
+#   tests/stream_rss.sh [max_mb [slack_kb]]
+#
+# IRGen streams about 1.5 MB/s, so the 1 GB step alone takes over ten minutes.
+# The tools are built with $CC (default cc) in a temporary directory, where
+# the generated source is also written.
+set -u
+root=$(cd "$(dirname "$0")/.." && pwd)
+cc=${CC:-cc}
+max_mb=${1:-1024}
+slack_kb=${2:-1024}
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+build() {
+    if ! $cc -std=gnu17 -O2 -o "$work/$1" "$root/$2"; then
+        echo "Cannot build $2"
+        exit 1
+    fi
+}
+build irgen IRGen/main.c
+build bcgen BCGen/mainbc.c
+
+# Three statements over three variables, repeated until the file has the
+# requested size
+generate() {
+    awk -v bytes=$(($1 * 1024 * 1024)) 'BEGIN {
+        print "DECLARE a : INTEGER"; print "DECLARE b : INTEGER"; print "DECLARE c : INTEGER"
+        n = 60
+        while (n < bytes) {
+            print "a <- a b + 7 /"; print "b <- b 3 * c -"; print "c <- a b + c 5 * -"
+            n += 49
+        }
+        print "OUTPUT a"
+    }' > "$work/x.pseu"
+}
+
+peak() {
+    sed -n 's/.*"peak_rss_kb": \([0-9]*\).*/\1/p' "$1"
+}
+
+printf '%8s %12s %14s %14s %14s\n' "MB" "statements" "irgen KB" "bcgen KB" "no-stream KB"
+failed=0
+base_ir=""
+mb=1
+while [ $mb -le "$max_mb" ]; do
+    generate $mb
+    statements=$(wc -l < "$work/x.pseu")
+    if ! "$work/irgen" --stream --stats=json "$work/x.pseu" - 2> "$work/ir.json" \
+        | "$work/bcgen" --stats=json - /dev/null 2> "$work/bc.json" > "$work/log"; then
+        echo "FAIL $mb MB: does not compile"
+        cat "$work/log" "$work/ir.json" "$work/bc.json"
+        exit 1
+    fi
+    ir=$(peak "$work/ir.json")
+    bc=$(peak "$work/bc.json")
+    full="-"
+    if [ $mb -le 16 ] && "$work/irgen" --stats=json "$work/x.pseu" /dev/null 2> "$work/full.json" > /dev/null; then
+        full=$(peak "$work/full.json")
+    fi
+    printf '%8d %12d %14d %14d %14s\n' $mb "$statements" "$ir" "$bc" "$full"
+    if [ -z "$base_ir" ]; then
+        base_ir=$ir
+        base_bc=$bc
+    elif [ "$ir" -gt $((base_ir + slack_kb)) ] || [ "$bc" -gt $((base_bc + slack_kb)) ]; then
+        echo "FAIL $mb MB: peak RSS grew by more than $slack_kb KB"
+        failed=1
+    fi
+    mb=$((mb * 4))
+done
+rm -f "$work/x.pseu"
+[ $failed -eq 0 ] && echo "ok   peak RSS flat up to $max_mb MB"
+exit $failed